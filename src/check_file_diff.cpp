@@ -2,6 +2,7 @@
 #include "include/common.hpp"
 #include "include/cmdline.hpp"
 #include "include/record.hpp"
+#include "include/run_reader.hpp"
 #include <cassert>
 #include <string>
 
@@ -18,8 +19,9 @@ int main(int argc, char* argv[]) {
         std::cerr << "openFile failed for " << filename1 << " or " << filename2 << ": " << strerror(errno) << std::endl;
         exit(EXIT_FAILURE);
     }
-    readRecordsFromFile(fd1, records1, 0, getFileSize(filename1));
-    readRecordsFromFile(fd2, records2, 0, getFileSize(filename2));
+    RunReader reader1(fd1), reader2(fd2);
+    reader1.read(records1, reader1.remaining());
+    reader2.read(records2, reader2.remaining());
     assert(records1.size() == records2.size());
     for (size_t i = 0; i < records1.size(); ++i) {
         if (
@@ -0,0 +1,271 @@
+#ifndef _BLOCK_CODEC_HPP
+#define _BLOCK_CODEC_HPP
+
+#include "config.hpp"
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unistd.h>
+
+/**
+ * Block-compressed format of the temporary runs, used for the tiers in COMPRESSED_TIERS.
+ * The serialized records are cut into blocks of RUN_BLOCK_SIZE bytes (records may span
+ * two blocks), each one stored as a BlockHeader followed by its bytes compressed with
+ * lzCompress, or as they are if they don't shrink. A RunFooter with the size of the
+ * records closes the file, so that the merges know where the run ends.
+ * The files in this format are the ones whose name ends with COMPRESSED_RUN_SUFFIX.
+ */
+static constexpr size_t RUN_BLOCK_SIZE = 64 * 1024;
+static constexpr const char* COMPRESSED_RUN_SUFFIX = ".lz";
+static constexpr uint64_t COMPRESSED_RUN_MAGIC = 0x314e55525a4c534dULL; // "MSLZRUN1"
+
+struct BlockHeader {
+    uint32_t raw_len;
+    uint32_t stored_len; // Equal to raw_len if the block is stored uncompressed
+};
+
+struct RunFooter {
+    uint64_t raw_bytes;
+    uint64_t magic;
+};
+
+static bool isCompressedRun(const std::string& name) {
+    const size_t n = std::strlen(COMPRESSED_RUN_SUFFIX);
+    return name.size() >= n && name.compare(name.size() - n, n, COMPRESSED_RUN_SUFFIX) == 0;
+}
+
+/* Size of the records of a run of file_size bytes, read from its footer, that must have the given magic */
+static uint64_t readRunFooter(int fd, size_t file_size, uint64_t magic) {
+    RunFooter footer;
+    if (file_size < sizeof(footer)
+        || pread(fd, &footer, sizeof(footer), file_size - sizeof(footer)) != sizeof(footer)
+        || footer.magic != magic) {
+        std::cerr << "Not a run in the expected format, the footer is missing" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    return footer.raw_bytes;
+}
+
+/**
+ * LZ77 codec in the style of LZ4: a block is a sequence of (literals, match) pairs,
+ * each introduced by a token with the literal length in the high nibble and the
+ * match length minus LZ_MIN_MATCH in the low one (15 means that bytes of 255 follow),
+ * then the literals, a 16 bit little endian offset and the rest of the match length.
+ * The last pair of a block has literals only.
+ * Matches are found with a single probe of a hash table of the 4 byte sequences,
+ * which skips faster over incompressible bytes, like random payloads.
+ */
+static constexpr size_t LZ_MIN_MATCH = 4;
+static constexpr unsigned int LZ_HASH_BITS = 12;
+static constexpr size_t LZ_MAX_OFFSET = 65535;
+
+/* Largest compressed size of n bytes */
+static constexpr size_t lzBound(size_t n) { return n + n / 255 + 16; }
+
+static inline uint32_t lzLoad32(const char* p) {
+    uint32_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline char* lzWriteLength(char* out, size_t len) {
+    for (; len >= 255; len -= 255) *out++ = static_cast<char>(255);
+    *out++ = static_cast<char>(len);
+    return out;
+}
+
+/* Write a pair with the literals [literals, literals + nliterals) and a match, if match_len > 0 */
+static inline char* lzWritePair(char* out, const char* literals, size_t nliterals, size_t offset, size_t match_len) {
+    char* token = out++;
+    const size_t extra = match_len ? match_len - LZ_MIN_MATCH : 0;
+    *token = static_cast<char>((std::min<size_t>(nliterals, 15) << 4) | std::min<size_t>(extra, 15));
+    if (nliterals >= 15) out = lzWriteLength(out, nliterals - 15);
+    std::memcpy(out, literals, nliterals);
+    out += nliterals;
+    if (match_len) {
+        *out++ = static_cast<char>(offset & 0xFF);
+        *out++ = static_cast<char>(offset >> 8);
+        if (extra >= 15) out = lzWriteLength(out, extra - 15);
+    }
+    return out;
+}
+
+/**
+ * Compress n bytes of src into dst, that must have room for lzBound(n) bytes.
+ *
+ * @return The compressed size.
+ */
+static size_t lzCompress(const char* src, size_t n, char* dst) {
+    uint32_t table[1u << LZ_HASH_BITS] = {}; // Position + 1 of the last sequence with each hash
+    char* out = dst;
+    size_t anchor = 0, i = 0;
+    while (n >= LZ_MIN_MATCH && i <= n - LZ_MIN_MATCH) {
+        const uint32_t sequence = lzLoad32(src + i);
+        const uint32_t hash = (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+        const size_t candidate = table[hash];
+        table[hash] = static_cast<uint32_t>(i + 1);
+
+        if (candidate == 0 || i + 1 - candidate > LZ_MAX_OFFSET || lzLoad32(src + candidate - 1) != sequence) {
+            /* The longer nothing matches, the bigger the steps */
+            i += 1 + ((i - anchor) >> 6);
+            continue;
+        }
+        const size_t ref = candidate - 1;
+        size_t len = LZ_MIN_MATCH;
+        /* Extend the match 8 bytes at a time, the first differing byte ends it */
+        while (i + len + sizeof(uint64_t) <= n) {
+            uint64_t a, b;
+            std::memcpy(&a, src + ref + len, sizeof(a));
+            std::memcpy(&b, src + i + len, sizeof(b));
+            if (a != b) {
+                len += __builtin_ctzll(a ^ b) / 8;
+                break;
+            }
+            len += sizeof(uint64_t);
+        }
+        if (i + len + sizeof(uint64_t) > n)
+            while (i + len < n && src[ref + len] == src[i + len]) len++;
+
+        out = lzWritePair(out, src + anchor, i - anchor, i - ref, len);
+        i += len;
+        anchor = i;
+    }
+    out = lzWritePair(out, src + anchor, n - anchor, 0, 0);
+    return out - dst;
+}
+
+static inline bool lzReadLength(const char*& in, const char* end, size_t& len) {
+    unsigned char byte;
+    do {
+        if (in == end) return false;
+        byte = static_cast<unsigned char>(*in++);
+        len += byte;
+    } while (byte == 255);
+    return true;
+}
+
+/**
+ * Decompress n bytes of src into exactly raw bytes at dst.
+ *
+ * @return Whether the block was well formed.
+ */
+static bool lzDecompress(const char* src, size_t n, char* dst, size_t raw) {
+    const char* in = src;
+    const char* in_end = src + n;
+    char* out = dst;
+    char* out_end = dst + raw;
+    while (in < in_end) {
+        const unsigned char token = static_cast<unsigned char>(*in++);
+        size_t nliterals = token >> 4;
+        if (nliterals == 15 && !lzReadLength(in, in_end, nliterals)) return false;
+        if (nliterals > static_cast<size_t>(in_end - in) || nliterals > static_cast<size_t>(out_end - out)) return false;
+        std::memcpy(out, in, nliterals);
+        in += nliterals;
+        out += nliterals;
+        if (in == in_end) break; // The last pair has no match
+
+        if (in_end - in < 2) return false;
+        const size_t offset = static_cast<unsigned char>(in[0]) | (static_cast<unsigned char>(in[1]) << 8);
+        in += 2;
+        size_t len = token & 15;
+        if (len == 15 && !lzReadLength(in, in_end, len)) return false;
+        len += LZ_MIN_MATCH;
+        if (offset == 0 || offset > static_cast<size_t>(out - dst) || len > static_cast<size_t>(out_end - out))
+            return false;
+
+        const char* match = out - offset;
+        if (offset >= len) {
+            std::memcpy(out, match, len);
+            out += len;
+        } else {
+            /* The match overlaps the bytes it produces, like a run of the same byte */
+            for (size_t k = 0; k < len; k++) *out++ = match[k];
+        }
+    }
+    return out == out_end;
+}
+
+/* Growable byte buffer for the decoded windows of a compressed run */
+struct DecodeBuffer {
+    std::unique_ptr<char[]> data;
+    size_t size = 0;
+    size_t capacity = 0;
+
+    void reserve(size_t bytes) {
+        if (bytes <= capacity) return;
+        size_t new_capacity = std::max(bytes, 2 * capacity);
+        std::unique_ptr<char[]> grown(new char[new_capacity]);
+        if (size) std::memcpy(grown.get(), data.get(), size);
+        data = std::move(grown);
+        capacity = new_capacity;
+    }
+};
+
+/**
+ * Background thread running the decoding of compressed merge inputs in order.
+ * It is shared by all the inputs of a merge: while the merge consumes the window
+ * of an input, the next one is decoded here.
+ */
+struct DecodeWorker {
+    struct Job {
+        std::function<void()> run;
+        bool done = true;
+    };
+
+    std::deque<Job*> pending;
+    bool stop = false;
+    std::mutex mutex;
+    std::condition_variable job_ready, job_done;
+    std::thread worker;
+
+    DecodeWorker() : worker([this] { serve(); }) {}
+
+    ~DecodeWorker() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        job_ready.notify_one();
+        worker.join();
+    }
+
+    void post(Job* job) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            job->done = false;
+            pending.push_back(job);
+        }
+        job_ready.notify_one();
+    }
+
+    void wait(Job* job) {
+        std::unique_lock<std::mutex> lock(mutex);
+        job_done.wait(lock, [job] { return job->done; });
+    }
+
+    void serve() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            job_ready.wait(lock, [this] { return stop || !pending.empty(); });
+            if (pending.empty()) return;
+            Job* job = pending.front();
+            pending.pop_front();
+            lock.unlock();
+            job->run();
+            lock.lock();
+            job->done = true;
+            job_done.notify_all();
+        }
+    }
+};
+
+#endif // _BLOCK_CODEC_HPP
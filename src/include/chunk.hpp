@@ -0,0 +1,269 @@
+#ifndef _CHUNK_HPP
+#define _CHUNK_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+/* Size of the on-disk record header: key + len */
+static constexpr size_t RECORD_HEADER_SIZE = sizeof(uint64_t) + sizeof(uint32_t);
+
+/**
+ * Layout of records with any payload length, the only way to find the next
+ * boundary is to read the length in the header of the current record.
+ */
+struct VariableLayout {
+    static size_t recordSize(const char* record) {
+        uint32_t len;
+        std::memcpy(&len, record + sizeof(uint64_t), sizeof(len));
+        return RECORD_HEADER_SIZE + static_cast<size_t>(len);
+    }
+};
+
+/**
+ * Layout of records that all have the same payload length: every boundary is a
+ * multiple of the stride, so chunking needs no scan of the headers at all.
+ */
+struct FixedLayout {
+    size_t stride;
+
+    size_t recordSize(const char*) const { return stride; }
+    /* Bytes taken by the whole records in the first limit bytes */
+    size_t wholeBytes(size_t limit) const { return (limit / stride) * stride; }
+};
+
+/**
+ * Call visit(key, offset) for every whole record at the start of data, up to limit bytes.
+ * With a FixedLayout the offsets are computed, so the iterations are independent.
+ *
+ * @return The number of bytes taken by the visited records.
+ */
+template<typename Layout, typename Visit>
+static inline size_t indexRecords(const char* data, size_t limit, const Layout& layout, Visit visit) {
+    uint64_t key;
+    if constexpr (std::is_same_v<Layout, FixedLayout>) {
+        size_t bytes = layout.wholeBytes(limit);
+        for (size_t pos = 0; pos < bytes; pos += layout.stride) {
+            std::memcpy(&key, data + pos, sizeof(key));
+            visit(key, pos);
+        }
+        return bytes;
+    } else {
+        size_t pos = 0;
+        while (pos + RECORD_HEADER_SIZE <= limit) {
+            size_t record_size = layout.recordSize(data + pos);
+            if (pos + record_size > limit) break;
+            std::memcpy(&key, data + pos, sizeof(key));
+            visit(key, pos);
+            pos += record_size;
+        }
+        return pos;
+    }
+}
+
+/**
+ * Index entry of a record stored in a RecordChunk.
+ * The key is duplicated here so that sorting never touches the slab, while
+ * offset points to the start of the serialized record (key|len|payload).
+ * The length is not stored since it is right after the key in the slab,
+ * this keeps the entry at 16 bytes.
+ */
+struct RecordTag {
+    unsigned long key;
+    uint64_t offset;
+
+    bool operator < (const RecordTag &a) const { return key < a.key; }
+};
+
+/**
+ * A chunk of records kept in their serialized form inside a single slab.
+ * Instead of one heap allocation per Record, the payloads of a whole chunk
+ * are allocated once (the slab is reused across clear() calls) and freed once.
+ * Sorting is done on the tags, the slab is only read when writing the records back.
+ */
+struct RecordChunk {
+    std::unique_ptr<char[]> slab;
+    size_t capacity = 0;
+    size_t used = 0;
+    std::vector<RecordTag> tags;
+
+    /**
+     * Make room for at least `bytes` bytes in the slab. The offsets in the tags
+     * are relative to the slab, so growing it does not invalidate them.
+     */
+    void reserve(size_t bytes) {
+        if (bytes <= capacity) return;
+        /* Not value-initialized on purpose, the pages are touched only when filled */
+        std::unique_ptr<char[]> new_slab(new char[bytes]);
+        if (used) std::memcpy(new_slab.get(), slab.get(), used);
+        slab = std::move(new_slab);
+        capacity = bytes;
+    }
+
+    /**
+     * Parse the serialized records in data and append them to the chunk.
+     * Only whole records are taken and at most max_bytes are consumed.
+     * The headers are scanned first, then the whole span is copied with a single memcpy.
+     *
+     * @return The number of bytes appended.
+     */
+    template<typename Layout = VariableLayout>
+    size_t appendRecords(const char* data, size_t size, size_t max_bytes, const Layout& layout = Layout()) {
+        size_t base = used;
+        size_t pos = indexRecords(data, std::min(size, max_bytes), layout, [&](uint64_t key, size_t offset) {
+            tags.push_back({key, base + offset});
+        });
+
+        if (used + pos > capacity)
+            reserve(std::max(used + pos, capacity * 2));
+        std::memcpy(slab.get() + used, data, pos);
+        used += pos;
+        return pos;
+    }
+
+    /* Append a single serialized record whose key is already known */
+    void append(unsigned long key, const char* record, size_t record_size) {
+        if (used + record_size > capacity)
+            reserve(std::max(used + record_size, capacity * 2));
+        std::memcpy(slab.get() + used, record, record_size);
+        tags.push_back({key, used});
+        used += record_size;
+    }
+
+    /* Whether record_size bytes can be appended without growing the slab */
+    bool fits(size_t record_size) const { return used + record_size <= capacity; }
+
+    const char* record(const RecordTag& tag) const { return slab.get() + tag.offset; }
+
+    uint32_t len(const RecordTag& tag) const {
+        uint32_t len;
+        std::memcpy(&len, record(tag) + sizeof(uint64_t), sizeof(len));
+        return len;
+    }
+
+    size_t recordSize(const RecordTag& tag) const { return RECORD_HEADER_SIZE + len(tag); }
+
+    size_t size() const { return tags.size(); }
+    size_t bytes() const { return used; }
+    bool empty() const { return tags.empty(); }
+
+    /* Drop the records but keep the slab for the next chunk */
+    void clear() {
+        tags.clear();
+        used = 0;
+    }
+};
+
+/**
+ * Tags over a read-only mapping of a region of the input file.
+ * Unlike RecordChunk, the records are never copied: the tags are sorted and
+ * the records are gathered straight from the mapping when the run is written.
+ * The mapping belongs to the RunReader the records were read with, so the chunk
+ * must be written before the next read.
+ */
+struct MappedChunk {
+    const char* base = nullptr;
+    size_t used = 0;
+    std::vector<RecordTag> tags;
+
+    /**
+     * Index the records of a mapped region, replacing the previous ones.
+     * Only whole records are indexed and at most max_bytes are covered.
+     *
+     * @return The number of bytes indexed.
+     */
+    template<typename Layout = VariableLayout>
+    size_t view(const char* data, size_t max_bytes, const Layout& layout = Layout()) {
+        clear();
+        base = data;
+        used = indexRecords(base, max_bytes, layout, [&](uint64_t key, size_t offset) {
+            tags.push_back({key, offset});
+        });
+        return used;
+    }
+
+    const char* record(const RecordTag& tag) const { return base + tag.offset; }
+
+    uint32_t len(const RecordTag& tag) const {
+        uint32_t len;
+        std::memcpy(&len, record(tag) + sizeof(uint64_t), sizeof(len));
+        return len;
+    }
+
+    size_t recordSize(const RecordTag& tag) const { return RECORD_HEADER_SIZE + len(tag); }
+
+    size_t size() const { return tags.size(); }
+    size_t bytes() const { return used; }
+    bool empty() const { return tags.empty(); }
+
+    void clear() {
+        base = nullptr;
+        used = 0;
+        tags.clear();
+    }
+};
+
+/**
+ * A record with a payload of exactly PAYLOAD bytes, laid out as on disk.
+ * It is packed so that an array of them is byte for byte a run of such records,
+ * and it is sorted in place: for small payloads moving the whole record is about
+ * as cheap as moving a tag, and the run is then written with a single copy.
+ */
+template<size_t PAYLOAD>
+struct __attribute__((packed)) FixedRecord {
+    unsigned long key;
+    uint32_t len;
+    char payload[PAYLOAD];
+
+    /* Left uninitialized on purpose, the records are always overwritten by a read */
+    FixedRecord() {}
+
+    bool operator < (const FixedRecord &a) const { return key < a.key; }
+};
+
+/**
+ * A chunk of records that all have a PAYLOAD bytes payload.
+ * The records are copied as they are from the input and sorted in place, so
+ * no tags are needed and the stride is a compile-time constant.
+ */
+template<size_t PAYLOAD>
+struct FixedChunk {
+    static constexpr size_t STRIDE = RECORD_HEADER_SIZE + PAYLOAD;
+    static_assert(sizeof(FixedRecord<PAYLOAD>) == STRIDE, "FixedRecord must have the on-disk layout");
+
+    std::vector<FixedRecord<PAYLOAD>> records;
+
+    void reserve(size_t bytes) { records.reserve(bytes / STRIDE); }
+
+    /**
+     * Append the whole records at the start of data, at most max_bytes are consumed.
+     *
+     * @return The number of bytes appended.
+     */
+    size_t appendRecords(const char* data, size_t size, size_t max_bytes) {
+        size_t n = std::min(size, max_bytes) / STRIDE;
+        size_t old_size = records.size();
+        records.resize(old_size + n);
+        std::memcpy(static_cast<void*>(records.data() + old_size), data, n * STRIDE);
+        return n * STRIDE;
+    }
+
+    const char* data() const { return reinterpret_cast<const char*>(records.data()); }
+
+    size_t size() const { return records.size(); }
+    size_t bytes() const { return records.size() * STRIDE; }
+    bool empty() const { return records.empty(); }
+    void clear() { records.clear(); }
+};
+
+template<typename T>
+struct is_fixed_chunk : std::false_type {};
+
+template<size_t PAYLOAD>
+struct is_fixed_chunk<FixedChunk<PAYLOAD>> : std::true_type {};
+
+#endif // _CHUNK_HPP
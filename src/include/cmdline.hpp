@@ -1,6 +1,7 @@
 #ifndef _CMDLINE_HPP
 #define _CMDLINE_HPP
 
+#include <algorithm>
 #include <cstdio>
 #include <linux/limits.h>
 #include <string>
@@ -18,9 +19,19 @@ static inline void usage(const char *argv0) {
     std::printf(" -t T: number of threads (default=%d)\n", NTHREADS);
     std::printf(" -k: use k-way merge in the sequential version (default=%s)\n", KWAY_MERGE ? "true" : "false");
     std::printf(" -m M: set the max memory usage (default=%ld)\n", MAX_MEMORY);
-    std::printf(" -p string: set the tmp location for the worker nodes (MPI) (default=%s)\n", TMP_LOCATION);
+    std::printf(" -b B: smallest read worth doing from a merge input, it bounds the inputs of a merge (default=%zu)\n", MERGE_MIN_READ);
+    std::printf(" -p dir[,dir...]: scratch directories for the temporary files, the first one is the tmp location of the worker nodes (MPI) (default=%s)\n", TMP_LOCATION);
+    std::printf(" -P rr|free: spread the temporary files over the scratch directories in turn or by free space (default=rr)\n");
     std::printf(" -x: set FF_NO_MAPPING variable to false (default=%s)\n", FF_NO_MAPPING ? "true" : "false");
     std::printf(" -y: set FF_BLOCKING_MODE variable to true (default=%s)\n", FF_BLOCKING_MODE ? "true" : "false");
+    std::printf(" -g: generate runs sorting (key, offset) tags over the mapped input (default=%s)\n", TAG_SORT ? "true" : "false");
+    std::printf(" -R: use radix sort instead of std::sort to generate the runs (default=%s)\n", RADIX_SORT ? "true" : "false");
+    std::printf(" -f: all the records have the same payload length, probed from the input (default=%s)\n", FIXED_RECORDS ? "true" : "false");
+    std::printf(" -u: read and write the merge files with io_uring (default=%s)\n", IO_URING ? "true" : "false");
+    std::printf(" -D: write the runs and the output, and read the runs, with direct I/O (default=%s)\n", DIRECT_IO ? "true" : "false");
+    std::printf(" -S none|close|batch: when the final output is synced to storage (default=close)\n");
+    std::printf(" -z none|runs|merges|all: temporary files written block-compressed (default=none)\n");
+    std::printf(" -c: write the temporary files with the keys apart from the payloads (default=%s)\n", COLUMNAR_RUNS ? "true" : "false");
     std::printf("--------------------\n");
     /**
      * These options are still relevant for the generation of the file,
@@ -45,7 +56,7 @@ static bool isNumber(const char* s, long &n) {
 
 static inline int parseCommandLine(int argc, char *argv[]) {
     extern char *optarg;
-    const std::string optstr = "r:s:t:d:m:p:kxy";
+    const std::string optstr = "r:s:t:d:m:b:p:P:kxygRfuDcS:z:";
     long opt, start = 1;
 
     while ((opt = getopt(argc, argv, optstr.c_str())) != -1) {
@@ -62,8 +73,85 @@ static inline int parseCommandLine(int argc, char *argv[]) {
                 FF_BLOCKING_MODE = true;
                 start += 1;
             } break;
+            case 'g': {
+                TAG_SORT = true;
+                start += 1;
+            } break;
+            case 'R': {
+                RADIX_SORT = true;
+                start += 1;
+            } break;
+            case 'f': {
+                FIXED_RECORDS = true;
+                start += 1;
+            } break;
+            case 'u': {
+                IO_URING = true;
+                start += 1;
+            } break;
+            case 'D': {
+                DIRECT_IO = true;
+                start += 1;
+            } break;
+            case 'c': {
+                COLUMNAR_RUNS = true;
+                start += 1;
+            } break;
+            case 'S': {
+                if (strcmp(optarg, "none") == 0)
+                    OUTPUT_DURABILITY = Durability::None;
+                else if (strcmp(optarg, "close") == 0)
+                    OUTPUT_DURABILITY = Durability::AtClose;
+                else if (strcmp(optarg, "batch") == 0)
+                    OUTPUT_DURABILITY = Durability::PerBatch;
+                else {
+                    std::fprintf(stderr, "Error: wrong '-S' option\n");
+                    usage(argv[0]);
+                    return -1;
+                }
+                start += 2;
+            } break;
+            case 'z': {
+                if (strcmp(optarg, "none") == 0)
+                    COMPRESSED_TIERS = 0;
+                else if (strcmp(optarg, "runs") == 0)
+                    COMPRESSED_TIERS = RUN_TIER;
+                else if (strcmp(optarg, "merges") == 0)
+                    COMPRESSED_TIERS = MERGE_TIER;
+                else if (strcmp(optarg, "all") == 0)
+                    COMPRESSED_TIERS = RUN_TIER | MERGE_TIER;
+                else {
+                    std::fprintf(stderr, "Error: wrong '-z' option\n");
+                    usage(argv[0]);
+                    return -1;
+                }
+                start += 2;
+            } break;
             case 'p': {
-                strncpy(TMP_LOCATION, optarg, PATH_MAX);
+                SCRATCH_DIRS.clear();
+                std::string dirs = optarg;
+                for (size_t begin = 0, end; begin <= dirs.size(); begin = end + 1) {
+                    end = std::min(dirs.find(',', begin), dirs.size());
+                    if (end > begin) SCRATCH_DIRS.push_back(dirs.substr(begin, end - begin));
+                }
+                if (SCRATCH_DIRS.empty()) {
+                    std::fprintf(stderr, "Error: wrong '-p' option\n");
+                    usage(argv[0]);
+                    return -1;
+                }
+                strncpy(TMP_LOCATION, SCRATCH_DIRS[0].c_str(), PATH_MAX);
+                start += 2;
+            } break;
+            case 'P': {
+                if (strcmp(optarg, "rr") == 0)
+                    SCRATCH_PLACEMENT = ScratchPlacement::RoundRobin;
+                else if (strcmp(optarg, "free") == 0)
+                    SCRATCH_PLACEMENT = ScratchPlacement::FreeSpace;
+                else {
+                    std::fprintf(stderr, "Error: wrong '-P' option\n");
+                    usage(argv[0]);
+                    return -1;
+                }
                 start += 2;
             } break;
             case 's': {
@@ -86,6 +174,16 @@ static inline int parseCommandLine(int argc, char *argv[]) {
                 MAX_MEMORY = m;
                 start += 2;
             } break;
+            case 'b': {
+                long b = 0;
+                if (!isNumber(optarg, b) || b < 1) {
+                    std::fprintf(stderr, "Error: wrong '-b' option\n");
+                    usage(argv[0]);
+                    return -1;
+                }
+                MERGE_MIN_READ = b;
+                start += 2;
+            } break;
             case 'r': {
                 long r = 0;
                 if (!isNumber(optarg, r)) {
@@ -122,6 +220,11 @@ static inline int parseCommandLine(int argc, char *argv[]) {
                 return -1;
         }
     }
+    if (COLUMNAR_RUNS && COMPRESSED_TIERS) {
+        std::fprintf(stderr, "Error: '-c' and '-z' can't be used together\n");
+        usage(argv[0]);
+        return -1;
+    }
     return start;
 }
 #endif // _CMDLINE_HPP
@@ -0,0 +1,215 @@
+#ifndef _COLUMNAR_RUN_HPP
+#define _COLUMNAR_RUN_HPP
+
+#include "block_codec.hpp"
+#include "run_reader.hpp"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+/**
+ * Columnar format of the temporary runs, used when COLUMNAR_RUNS is set.
+ * The records are stored in segments of at most COLUMNAR_SEGMENT_RECORDS records, or
+ * about COLUMNAR_SEGMENT_BYTES of payloads, each one made of a ColumnarSegmentHeader
+ * followed by three columns:
+ *  - the keys as varints, the first one as it is and the others as the difference
+ *    with the previous one, which is small since the keys are sorted;
+ *  - the payload lengths as varints, their prefix sums are the offsets of the payloads;
+ *  - the payloads, one after the other.
+ * A RunFooter with the size of the records in the plain format closes the file.
+ * A merge decodes the key column of a segment into a dense array, and touches the
+ * payloads only when it writes the records out.
+ * The files in this format are the ones whose name ends with COLUMNAR_RUN_SUFFIX.
+ */
+static constexpr size_t COLUMNAR_SEGMENT_RECORDS = 1024;
+static constexpr size_t COLUMNAR_SEGMENT_BYTES = 256 * 1024;
+static constexpr const char* COLUMNAR_RUN_SUFFIX = ".col";
+static constexpr uint64_t COLUMNAR_RUN_MAGIC = 0x314e5552434c534dULL; // "MSLCRUN1"
+/* Largest encoding of a varint */
+static constexpr size_t VARINT_MAX_BYTES = 10;
+
+struct ColumnarSegmentHeader {
+    uint32_t records;
+    uint32_t key_bytes;
+    uint32_t len_bytes;
+    uint32_t payload_bytes;
+};
+
+static bool isColumnarRun(const std::string& name) {
+    const size_t n = std::strlen(COLUMNAR_RUN_SUFFIX);
+    return name.size() >= n && name.compare(name.size() - n, n, COLUMNAR_RUN_SUFFIX) == 0;
+}
+
+static inline char* putVarint(char* out, uint64_t value) {
+    for (; value >= 0x80; value >>= 7)
+        *out++ = static_cast<char>(value | 0x80);
+    *out++ = static_cast<char>(value);
+    return out;
+}
+
+static inline bool getVarint(const char*& in, const char* end, uint64_t& value) {
+    value = 0;
+    for (unsigned int shift = 0; shift < 64 && in < end; shift += 7) {
+        const unsigned char byte = static_cast<unsigned char>(*in++);
+        value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) return true;
+    }
+    return false;
+}
+
+/* Records of the segment being filled by a columnar RunWriter */
+struct ColumnarSegment {
+    std::vector<uint64_t> keys;
+    std::vector<uint32_t> lens;
+    std::vector<char> payloads;
+    std::vector<char> columns; // Header, key and length columns of the last segment encoded
+
+    ColumnarSegment() {
+        keys.reserve(COLUMNAR_SEGMENT_RECORDS);
+        lens.reserve(COLUMNAR_SEGMENT_RECORDS);
+        payloads.reserve(COLUMNAR_SEGMENT_BYTES);
+        columns.resize(sizeof(ColumnarSegmentHeader) + 2 * COLUMNAR_SEGMENT_RECORDS * VARINT_MAX_BYTES);
+    }
+
+    bool empty() const { return keys.empty(); }
+
+    bool full() const {
+        return keys.size() >= COLUMNAR_SEGMENT_RECORDS || payloads.size() >= COLUMNAR_SEGMENT_BYTES;
+    }
+
+    /* Bytes of the records of the segment in the plain format */
+    size_t rawBytes() const { return keys.size() * RECORD_HEADER_SIZE + payloads.size(); }
+
+    void add(uint64_t key, uint32_t len, const char* payload) {
+        keys.push_back(key);
+        lens.push_back(len);
+        payloads.insert(payloads.end(), payload, payload + len);
+    }
+
+    /**
+     * Encode the header and the key and length columns, the payload column follows them as it is.
+     *
+     * @return The bytes of columns used.
+     */
+    size_t encodeColumns() {
+        ColumnarSegmentHeader header;
+        char* out = columns.data() + sizeof(header);
+        uint64_t previous = 0;
+        for (uint64_t key : keys) {
+            out = putVarint(out, key - previous);
+            previous = key;
+        }
+        header.key_bytes = static_cast<uint32_t>(out - columns.data() - sizeof(header));
+        for (uint32_t len : lens)
+            out = putVarint(out, len);
+        header.records = static_cast<uint32_t>(keys.size());
+        header.len_bytes = static_cast<uint32_t>(out - columns.data() - sizeof(header) - header.key_bytes);
+        header.payload_bytes = static_cast<uint32_t>(payloads.size());
+        std::memcpy(columns.data(), &header, sizeof(header));
+        return out - columns.data();
+    }
+
+    void clear() {
+        keys.clear();
+        lens.clear();
+        payloads.clear();
+    }
+};
+
+/**
+ * Read cursor over a run in the columnar format, used by the merges.
+ * The run is mapped by a RunReader and walked a segment at a time: the key column is
+ * decoded into keys and the length column into the offsets of the payloads, which
+ * stay in the mapping until the records are written out.
+ */
+struct ColumnarCursor {
+    int fd;
+    RunReader reader;
+    size_t segment_offset = 0; // File offset of the next segment
+    size_t end = 0;            // File offset of the footer
+    size_t total_bytes = 0;    // Bytes of the records in the plain format
+    std::vector<uint64_t> keys;
+    std::vector<size_t> offsets; // Offset of every payload in the payload column, and the end of the last one
+    const char* payloads = nullptr;
+    size_t pos = 0;
+
+    explicit ColumnarCursor(int fd) : fd(fd), reader(fd) {
+        total_bytes = readRunFooter(fd, reader.length, COLUMNAR_RUN_MAGIC);
+        end = reader.length - sizeof(RunFooter);
+        keys.reserve(COLUMNAR_SEGMENT_RECORDS);
+        offsets.reserve(COLUMNAR_SEGMENT_RECORDS + 1);
+        loadSegment();
+    }
+
+    bool empty() const { return pos == keys.size(); }
+
+    uint64_t key() const { return keys[pos]; }
+
+    /* Decode the columns of the next segment, the cursor is left empty at the end of the run */
+    void loadSegment() {
+        keys.clear();
+        offsets.clear();
+        pos = 0;
+        if (segment_offset == end) return;
+
+        ColumnarSegmentHeader header;
+        if (end - segment_offset < sizeof(header)) corrupted();
+        std::memcpy(&header, reader.view(segment_offset, sizeof(header)), sizeof(header));
+        const size_t columns_len = static_cast<size_t>(header.key_bytes) + header.len_bytes;
+        const size_t segment_len = sizeof(header) + columns_len + header.payload_bytes;
+        if (end - segment_offset < segment_len) corrupted();
+
+        const char* in = reader.view(segment_offset, segment_len) + sizeof(header);
+        const char* keys_end = in + header.key_bytes;
+        uint64_t key = 0, delta;
+        for (uint32_t r = 0; r < header.records; r++) {
+            if (!getVarint(in, keys_end, delta)) corrupted();
+            key += delta;
+            keys.push_back(key);
+        }
+        const char* lens_end = keys_end + header.len_bytes;
+        uint64_t len;
+        offsets.push_back(0);
+        for (uint32_t r = 0; r < header.records; r++) {
+            if (!getVarint(in, lens_end, len)) corrupted();
+            offsets.push_back(offsets.back() + len);
+        }
+        if (in != lens_end || offsets.back() != header.payload_bytes) corrupted();
+        payloads = lens_end;
+        segment_offset += segment_len;
+    }
+
+    /**
+     * End of the records from pos whose keys are not greater than bound, in the current
+     * segment. The key column is dense, so it is an exponential search and a binary one.
+     */
+    size_t gallop(uint64_t bound) const {
+        size_t lo = pos, step = 1;
+        while (lo + step <= keys.size() && keys[lo + step - 1] <= bound) {
+            lo += step;
+            step *= 2;
+        }
+        const size_t hi = std::min(lo + step - 1, keys.size());
+        return std::upper_bound(keys.begin() + lo, keys.begin() + hi, bound) - keys.begin();
+    }
+
+    /* Write the records [pos, last) with append_record(key, len, payload) and move past them */
+    template<typename Append>
+    void emit(size_t last, Append&& append_record) {
+        for (; pos < last; pos++)
+            append_record(keys[pos], static_cast<uint32_t>(offsets[pos + 1] - offsets[pos]), payloads + offsets[pos]);
+        if (empty())
+            loadSegment();
+    }
+
+    [[noreturn]] static void corrupted() {
+        std::cerr << "Corrupted segment in a columnar run" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+};
+
+#endif // _COLUMNAR_RUN_HPP
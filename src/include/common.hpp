@@ -1,8 +1,11 @@
 #ifndef _COMMON_HPP
 #define _COMMON_HPP
 
+#include "chunk.hpp"
 #include "config.hpp"
+#include "offset_index.hpp"
 #include "record.hpp"
+#include <atomic>
 #include <cerrno>
 #include <cstddef>
 #include <cstdint>
@@ -13,8 +16,10 @@
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <filesystem>
 #include <iostream>
 #include <linux/magic.h>
+#include <mutex>
 #include <queue>
 #include <stdlib.h>
 #include <string>
@@ -28,6 +33,13 @@
 #include <sstream>
 #include <iomanip>
 
+/* Buffers of already serialized records, whatever their allocator */
+template<typename T>
+struct is_byte_buffer : std::false_type {};
+
+template<typename Allocator>
+struct is_byte_buffer<std::vector<char, Allocator>> : std::true_type {};
+
 template<typename Container>
 static ssize_t appendToFile(int fd, Container&& records, ssize_t size);
 static int openFile(const std::string& filename, bool append = false);
@@ -71,6 +83,10 @@ static void generateFile(std::string filename) {
         }
     }
 
+    /* The index covers the file from its start, it can't be written when appending to one */
+    off_t initial_size = lseek(fd, 0, SEEK_END);
+    OffsetIndexBuilder index;
+
     Record record;
     std::deque<Record> records;
     size_t size = 0;
@@ -79,12 +95,13 @@ static void generateFile(std::string filename) {
     std::uniform_int_distribution<uint32_t> dist32;
     for (size_t i = 0; i < ARRAY_SIZE; i++) {
         record.key = dist32(gen);
-        record.len = rand() % (RECORD_SIZE - 8) + 8;
+        record.len = FIXED_RECORDS ? RECORD_SIZE : rand() % (RECORD_SIZE - 8) + 8;
         record.rpayload = std::make_unique<char[]>(record.len);
         for (size_t j = 0; j < record.len; j++)
             record.rpayload[j] = rand() & 0xFF;
 
         size += record.size();
+        index.add(record.size());
         records.push_back(record);
 
         if (size > MAX_MEMORY) {
@@ -103,6 +120,10 @@ static void generateFile(std::string filename) {
 
     printf("\rProgress: 100%%\n");
     close(fd);
+    if (initial_size == 0)
+        index.write(filename);
+    else
+        std::cerr << "Appended to an existing file, no offset index written" << std::endl;
 }
 
 
@@ -168,6 +189,89 @@ static size_t getFileSize(const std::string filename) {
     return stat_buf.st_size;
 }
 
+/* Records whose length is checked by probeRecordStride, spread evenly over the file */
+static constexpr size_t STRIDE_PROBE_SAMPLES = 64;
+
+/**
+ * Check that all the records of a file have the same length as the first one.
+ * The file size must be a multiple of that length and the header of the records
+ * found at STRIDE_PROBE_SAMPLES evenly spaced multiples of it must agree.
+ *
+ * @param filename The file to probe.
+ * @return The size of every record (header included), or 0 if they are not all the same.
+ */
+static size_t probeRecordStride(const std::string& filename) {
+    size_t file_size = getFileSize(filename);
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        std::cerr << "Error opening file: " << filename << " " << strerror(errno) << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    uint32_t len = 0;
+    size_t stride = 0;
+    if (pread(fd, &len, sizeof(len), sizeof(uint64_t)) == sizeof(len)) {
+        stride = RECORD_HEADER_SIZE + static_cast<size_t>(len);
+        if (file_size % stride != 0) stride = 0;
+    }
+
+    size_t nrecords = stride ? file_size / stride : 0;
+    for (size_t i = 0; stride && i < STRIDE_PROBE_SAMPLES; i++) {
+        size_t record = (i * nrecords) / STRIDE_PROBE_SAMPLES;
+        uint32_t sample = 0;
+        if (pread(fd, &sample, sizeof(sample), record * stride + sizeof(uint64_t)) != sizeof(sample) || sample != len)
+            stride = 0;
+    }
+    close(fd);
+
+    if (!stride)
+        std::cerr << "The records of " << filename << " don't have a fixed length, using the general path" << std::endl;
+    return stride;
+}
+
+/* Flush a file written by someone else (a run renamed to the output) to storage */
+static void syncFile(const std::string& filename) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0 || fdatasync(fd) != 0) {
+        std::cerr << "Error syncing file: " << filename << " " << strerror(errno) << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+}
+
+/**
+ * Path of a temporary file moved to one of the SCRATCH_DIRS, keeping its name.
+ * The directories are taken in turn, or with FreeSpace in proportion to the space
+ * left on their file systems (a smooth weighted round-robin), so that the files
+ * created at the same time by several threads still go to different devices.
+ * Without scratch directories the path is left as it is.
+ */
+static std::string scratchPath(const std::string& path) {
+    if (SCRATCH_DIRS.empty()) return path;
+    const std::string name = std::filesystem::path(path).filename().string();
+    size_t dir = 0;
+    if (SCRATCH_PLACEMENT == ScratchPlacement::RoundRobin) {
+        static std::atomic<size_t> next{0};
+        dir = next.fetch_add(1, std::memory_order_relaxed) % SCRATCH_DIRS.size();
+    } else {
+        static std::mutex mutex;
+        static std::vector<double> credit;
+        std::lock_guard<std::mutex> lock(mutex);
+        credit.resize(SCRATCH_DIRS.size(), 0);
+        double total = 0;
+        for (size_t i = 0; i < SCRATCH_DIRS.size(); i++) {
+            struct statfs st;
+            double free_bytes = (statfs(SCRATCH_DIRS[i].c_str(), &st) == 0)
+                ? static_cast<double>(st.f_bavail) * st.f_bsize : 0;
+            credit[i] += free_bytes;
+            total += free_bytes;
+            if (credit[i] > credit[dir]) dir = i;
+        }
+        credit[dir] -= total;
+    }
+    return SCRATCH_DIRS[dir] + "/" + name;
+}
+
 static bool deleteFile(const char* filename) {
     if (unlink(filename) == 0) {
         return true;
@@ -178,6 +282,12 @@ static bool deleteFile(const char* filename) {
     }
 }
 
+/* Delete a temporary run and its offset index, if it has one */
+static bool deleteRun(const std::string& run) {
+    unlink(offsetIndexName(run).c_str());
+    return deleteFile(run.c_str());
+}
+
 static int openFile(const std::string& filename, bool append) {
     int fd = open(filename.c_str(), O_RDWR | O_CREAT | (append ? O_APPEND : 0), 0666);
     if (fd < 0) {
@@ -192,108 +302,10 @@ static int openFile(const std::string& filename, bool append) {
     return fd;
 }
 
-/**
- * Read records from a file into a container that can be a vector, a deque or a priority queue.
- * It reads a chunk of data from the file and parses it into records to minimize the number of system calls.
- *
- * @param filename The name of the file to read from.
- * @param records The container to store the records in.
- * @param offset The offset in the file to start reading from.
- * @param max_mem The maximum amount of memory to use for reading.
- * @return The number of bytes read from the file.
- */
-template<typename Container>
-static size_t readRecordsFromFile(int fd, Container& records, size_t offset, size_t max_mem) {
-    /* Get file size */
-    struct stat st;
-    if (fstat(fd, &st) < 0) {
-        std::cerr << "fstat failed: " << strerror(errno) << std::endl;
-        exit(EXIT_FAILURE);
-    }
-    size_t file_size = static_cast<size_t>(st.st_size);
-    if (offset >= file_size) {
-        return 0; // nothing to read
-    }
-
-    /* === Page-align the mmap region === */
-    const long page_size = sysconf(_SC_PAGESIZE);
-
-    /**
-     * Let's say page_size is 4096 bytes.
-     * page_mask is 4095 -> 12 bits set to 1.
-     * Being an unsigned long its likely 64 bits -> ~page_mask is 1...100000000000
-     * Computing offset & ~page_mask clears off the lower 12 bits of the offset, giving us the highest multiple of page_size
-     * lower than the actual offset.
-     * So, to know the offset within the page, we simply compute offset - map_offset.
-     *
-     * Offset: 12345
-     * Map Offset: 12288
-     * Page Offset: 57
-     * File:   |------ Page0 ------|------ Page1 ------|------ Page2 ------|------ Page3 ------|
-     * Offset: 0                 4096                8192               12288   ^           16384
-     *                                                                          |
-     *                                                                  12288 + 57 = 12345
-     */
-    off_t map_offset = offset & ~(page_size - 1);  // align down
-    size_t start_in_map = offset - map_offset;  // where parsing starts within map
-    size_t max_map_len = std::min(max_mem + start_in_map, file_size - map_offset);
-    if (max_map_len == 0) {
-        return 0;
-    }
-
-    void* mapped = mmap(nullptr, max_map_len, PROT_READ, MAP_PRIVATE, fd, map_offset);
-    if (mapped == MAP_FAILED) {
-        std::cerr << "mmap failed: " << strerror(errno) << std::endl;
-        exit(EXIT_FAILURE);
-    }
-
-    const char* base = static_cast<const char*>(mapped);
-    size_t pos = start_in_map;
-    size_t total_bytes_parsed = 0;
-
-    while (true) {
-        /* need at least key + len */
-        if (pos + sizeof(uint64_t) + sizeof(uint32_t) > max_map_len) break;
-
-        uint64_t key;
-        uint32_t len;
-
-        std::memcpy(&key, base + pos, sizeof(key));
-        std::memcpy(&len, base + pos + sizeof(key), sizeof(len));
-
-        size_t record_size = sizeof(uint64_t) + sizeof(uint32_t) + static_cast<size_t>(len);
-
-        /* If record would cross mapped region or exceed allowed max_mem, stop */
-        if (
-            pos + record_size > max_map_len
-            || total_bytes_parsed + record_size > max_mem
-        ) break;
-
-        Record rec;
-        rec.key = key;
-        rec.len = len;
-        rec.rpayload = std::make_unique<char[]>(len);
-        std::memcpy(rec.rpayload.get(), base + pos + sizeof(uint64_t) + sizeof(uint32_t), len);
-
-        if constexpr (
-            std::is_same_v<Container, std::vector<Record>> ||
-            std::is_same_v<Container, std::deque<Record>>) {
-            records.push_back(std::move(rec));
-        } else {
-            records.push(std::move(rec));
-        }
-
-        pos += record_size;
-        total_bytes_parsed += record_size;
-    }
-
-    munmap(mapped, max_map_len);
-    return total_bytes_parsed;
-}
-
 /**
  * This function appends a list of records to a file using mmap,
  * returning the bytes written. Also, it clears the records Container before returning.
+ * A vector of chars is taken as already serialized records and copied as it is.
  * It expects the file to be already open.
  * @param fd The file descriptor of the file to append to.
  * @param records The records to append.
@@ -309,7 +321,13 @@ static ssize_t appendToFile(int fd, Container&& records, ssize_t size) {
     }
 
     size_t batch_size = size;
-    if constexpr (!std::is_same_v<Container, std::priority_queue<Record, std::vector<Record>, RecordComparator>>) {
+    if constexpr (std::is_same_v<Container, RecordChunk> || std::is_same_v<Container, MappedChunk> || is_fixed_chunk<Container>::value) {
+        if (batch_size <= 0)
+            batch_size = records.bytes();
+    } else if constexpr (is_byte_buffer<Container>::value) {
+        if (batch_size <= 0)
+            batch_size = records.size();
+    } else if constexpr (!std::is_same_v<Container, std::priority_queue<Record, std::vector<Record>, RecordComparator>>) {
         if (batch_size <= 0)
             for (const auto& record : records)
                 batch_size += record.size();
@@ -349,7 +367,17 @@ static ssize_t appendToFile(int fd, Container&& records, ssize_t size) {
         offset += record.len;
     };
 
-    if constexpr (std::is_same_v<Container, std::priority_queue<Record, std::vector<Record>, RecordComparator>>) {
+    if constexpr (is_byte_buffer<Container>::value || is_fixed_chunk<Container>::value) {
+        /* Raw serialized records, e.g. the output buffer of a merge or fixed records sorted in place */
+        memcpy(out, records.data(), batch_size);
+    } else if constexpr (std::is_same_v<Container, RecordChunk> || std::is_same_v<Container, MappedChunk>) {
+        /* Records are already serialized, just gather them in tag order */
+        for (const auto& tag : records.tags) {
+            size_t record_size = records.recordSize(tag);
+            memcpy(out + offset, records.record(tag), record_size);
+            offset += record_size;
+        }
+    } else if constexpr (std::is_same_v<Container, std::priority_queue<Record, std::vector<Record>, RecordComparator>>) {
         while (!records.empty()) {
             serialize_record(records.top());
             records.pop();
@@ -1,18 +1,41 @@
 #ifndef _CONFIG_HPP
 #define _CONFIG_HPP
+#include <cstddef>
 #include <cstdint>
 #include <linux/limits.h>
+#include <string>
 #include <sys/stat.h>
 #include <thread>
+#include <vector>
 
 static unsigned int NTHREADS = std::thread::hardware_concurrency();
 static unsigned int RECORD_SIZE = 64;
 static unsigned int ARRAY_SIZE = 10000;
 static unsigned int ROUNDS = 4;
 static uint64_t MAX_MEMORY = 1ULL << 33; // 8 GB
+static size_t MERGE_MIN_READ = 256UL << 10; // Smallest window worth reading from a merge input on the device
 static bool KWAY_MERGE = false;
 static char TMP_LOCATION[PATH_MAX+1] = "/tmp";
+/* Directories given with -p, the temporary files are spread across them (next to the input if empty) */
+static std::vector<std::string> SCRATCH_DIRS;
+enum class ScratchPlacement { RoundRobin, FreeSpace };
+static ScratchPlacement SCRATCH_PLACEMENT = ScratchPlacement::RoundRobin;
 static bool FF_NO_MAPPING = true;
 static bool FF_BLOCKING_MODE = false;
+static bool TAG_SORT = false;
+static bool RADIX_SORT = false;
+static bool FIXED_RECORDS = false;
+static bool IO_URING = false;
+static bool DIRECT_IO = false;
+[[maybe_unused]] static size_t RECORD_STRIDE = 0; // Size of every record when they are all the same, 0 otherwise
+
+/* When written data is flushed to storage: never, once when the file is closed, or after every buffer */
+enum class Durability { None, AtClose, PerBatch };
+static Durability OUTPUT_DURABILITY = Durability::AtClose; // The temporary files always use None
+
+/* Tiers of temporary files, the ones in COMPRESSED_TIERS are written in the block-compressed format */
+enum RunTier : unsigned int { RUN_TIER = 1, MERGE_TIER = 2 };
+static unsigned int COMPRESSED_TIERS = 0;
+static bool COLUMNAR_RUNS = false; // All the temporary files are written in the columnar format
 
 #endif // _CONFIG_HPP
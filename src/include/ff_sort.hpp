@@ -4,10 +4,13 @@
 #include "common.hpp"
 #include "config.hpp"
 #include "hpc_helpers.hpp"
+#include "partitioned_merge.hpp"
+#include "record_boundaries.hpp"
 #include "sorting.hpp"
 #include <algorithm>
 #include <cmath>
 #include <cstddef>
+#include <deque>
 #include <filesystem>
 #include <ff/ff.hpp>
 #include <ff/pipeline.hpp>
@@ -22,7 +25,6 @@ struct sort_task_t {
     size_t start;
     size_t size;
     size_t memory;
-    size_t w_id;
     std::vector<std::string> run_files;
 };
 
@@ -35,25 +37,38 @@ struct merge_task_t {
 struct work_t {
     struct sort_task_t *sort_task;
     struct merge_task_t *merge_task;
+    size_t w_id; // Worker running the task, it asks for the next one by sending it back
 };
 
 
+/**
+ * The tasks are handed out on demand: every worker has at most one task at a time,
+ * and gets the next one when it sends back the previous, so a slow chunk or a busy
+ * core does not hold back work queued behind it. Merge tasks go first, then the
+ * chunks still to sort; a worker that finds neither waits in idle_workers.
+ * The runs are grouped by the order in which their chunks finish, not by the worker
+ * that sorted them: every group_chunks sorted chunks, their runs become a merge task
+ * for the next free worker.
+ */
 struct Master : ff::ff_monode_t<work_t> {
-    size_t current_level;
-    std::vector<size_t> submitted_sort_tasks;
-    std::vector<std::vector<std::string>> run_files;
+    std::vector<size_t> bounds;            // Chunk i of the input is [bounds[i], bounds[i + 1])
+    size_t next_chunk;                     // First chunk not sent out yet
+    size_t running_sorts;
+    size_t running_merges;
+    size_t group_chunks;                   // Sorted chunks whose runs are merged together
+    size_t group_sorted;                   // Chunks of the current group sorted so far
+    std::vector<std::string> group_runs;   // Runs of the current group
+    std::deque<merge_task_t*> ready_merges;
+    std::vector<size_t> idle_workers;
     std::vector<std::string> merge_files;
-    size_t merge_count;
-    size_t pending_merges;
-    size_t expected_merges;
     size_t nworkers;
     std::string filename;
     std::string run_prefix;
     std::string merge_prefix;
     std::string output_file;
     Master(std::string filename, std::string base_path) :
-        current_level(0), submitted_sort_tasks(0), merge_count(0), pending_merges(0),
-        expected_merges(0), nworkers(NTHREADS-1), filename(filename), run_prefix(base_path+"/run#"),
+        next_chunk(0), running_sorts(0), running_merges(0), group_chunks(1), group_sorted(0),
+        nworkers(NTHREADS-1), filename(filename), run_prefix(base_path+"/run#"),
         merge_prefix(base_path+"/merge#"), output_file(base_path+"/output.dat") {}
 
     void kill_threads(size_t expected_merges) {
@@ -61,135 +76,89 @@ struct Master : ff::ff_monode_t<work_t> {
             ff_send_out_to(EOS, --nworkers);
     }
 
-    void send_out_sort_tasks() {
+    void find_chunks() {
         size_t file_size = getFileSize(filename);
         size_t max_mem_per_worker = MAX_MEMORY / NTHREADS;
         size_t chunk_size = std::min(file_size / 100, 3 * max_mem_per_worker); // 1% of the file or the memory per worker to keep them busy
-        int fd = openFile(filename);
-
-        /**
-         * While the master thread is skipping through the file,
-         * the memory usage is a little higher than the allowed memory.
-         * But it is the same in the omp implementation, so the comparison is fair.
-        */
-        std::vector<char> buffer(max_mem_per_worker);
-        size_t buffer_offset = 0, file_offset = 0, start_offset = 0, end_offset = 0;
-
-        size_t bytes_in_buffer = 0;
-        size_t worker_id = 0;
-        submitted_sort_tasks.resize(nworkers);
-
-        while (true) {
-            if (buffer_offset < bytes_in_buffer) {
-                memmove(buffer.data(), buffer.data() + buffer_offset, bytes_in_buffer - buffer_offset);
-                bytes_in_buffer -= buffer_offset;
-            } else {
-                bytes_in_buffer = 0;
-            }
-            buffer_offset = 0;
-
-            /* One single syscall is faster than reading key+len and lseek to the next key */
-            ssize_t bytes_read = read(fd, buffer.data() + bytes_in_buffer, buffer.size() - bytes_in_buffer);
-            if (bytes_read < 0) {
-                std::cerr << "Read error: " << strerror(errno) << std::endl;
-                close(fd);
-                return;
-            } else if (bytes_read == 0 && bytes_in_buffer == 0) {
-                break; // EOF
-            }
-            bytes_in_buffer += bytes_read;
-
-            while (buffer_offset + sizeof(uint64_t) + sizeof(uint32_t) <= bytes_in_buffer) {
-                size_t local_offset = buffer_offset;
-                buffer_offset += sizeof(uint64_t);
-                uint32_t len = *reinterpret_cast<uint32_t*>(&buffer[buffer_offset]);
-                buffer_offset += sizeof(uint32_t);
-
-                if (buffer_offset + len > bytes_in_buffer) {
-                    buffer_offset = local_offset;
-                    break;
-                }
-
-                buffer_offset += len;
-                end_offset = file_offset + buffer_offset;
-
-                if (end_offset - start_offset >= chunk_size) {
-                    size_t size = end_offset - start_offset;
-                    ff_send_out_to(new work_t{new sort_task_t{
-                        filename,
-                        start_offset,
-                        size,
-                        max_mem_per_worker,
-                        worker_id
-                    }, nullptr}, worker_id);
-                    submitted_sort_tasks[worker_id]++;
-                    worker_id = (worker_id + 1) % nworkers;
-                    start_offset = end_offset;
-                }
-            }
-
-            file_offset += buffer_offset;
-        }
 
-        if (end_offset > start_offset) {
-            size_t size = end_offset - start_offset;
+        /* The boundaries are found with all the threads, the workers are still idle */
+        bounds = findChunkBounds(filename, chunk_size, NTHREADS);
+        const size_t chunks = bounds.empty() ? 0 : bounds.size() - 1;
+        /* As many merges as workers, like when each one merged the runs of its share of chunks */
+        group_chunks = std::max<size_t>(1, (chunks + nworkers - 1) / nworkers);
+    }
+
+    /* Give worker w its next task, if there is one */
+    void dispatch(size_t w) {
+        if (!ready_merges.empty()) {
+            ff_send_out_to(new work_t{nullptr, ready_merges.front(), w}, w);
+            ready_merges.pop_front();
+            running_merges++;
+        } else if (next_chunk + 1 < bounds.size()) {
             ff_send_out_to(new work_t{new sort_task_t{
                 filename,
-                start_offset,
-                size,
-                max_mem_per_worker,
-                worker_id
-            }, nullptr}, worker_id);
-            submitted_sort_tasks[worker_id]++;
+                bounds[next_chunk],
+                bounds[next_chunk + 1] - bounds[next_chunk],
+                MAX_MEMORY / NTHREADS
+            }, nullptr, w}, w);
+            next_chunk++;
+            running_sorts++;
+        } else {
+            idle_workers.push_back(w);
         }
-        close(fd);
+    }
+
+    /* Turn the runs of the current group into a merge task, a single run needs none */
+    void close_group() {
+        if (group_runs.size() == 1) {
+            merge_files.push_back(std::move(group_runs[0]));
+        } else if (!group_runs.empty()) {
+            ready_merges.push_back(new merge_task_t{
+                std::move(group_runs),
+                runFileName(merge_prefix + generateUUID(), MERGE_TIER),
+                MAX_MEMORY/nworkers});
+        }
+        group_runs.clear();
+        group_sorted = 0;
     }
 
     work_t* svc(work_t* task) {
         if (!task) {
-            run_files.resize(nworkers);
-            send_out_sort_tasks();
-            return GO_ON;
-        } else if (task->sort_task) {
-            run_files[task->sort_task->w_id].insert(
-                run_files[task->sort_task->w_id].end(),
-               std::make_move_iterator(task->sort_task->run_files.begin()),
-               std::make_move_iterator(task->sort_task->run_files.end()));
-            if (--submitted_sort_tasks[task->sort_task->w_id] == 0) {
-                if (run_files[task->sort_task->w_id].size() == 1) {
-                    /* If it produced a single run file, it can be passed to the final merge */
-                    merge_files.push_back(run_files[task->sort_task->w_id][0]);
-                } else {
-                    std::string filename = merge_prefix + generateUUID();
-                    ff_send_out_to(new work_t{nullptr, new merge_task_t{
-                        std::move(run_files[task->sort_task->w_id]),
-                        filename,
-                        MAX_MEMORY/nworkers}}, task->sort_task->w_id);
-                    expected_merges++;
-                }
-            }
-            delete task->sort_task;
-            delete task;
+            find_chunks();
+            for (size_t w = 0; w < nworkers; w++)
+                dispatch(w);
             return GO_ON;
+        }
 
+        const size_t w = task->w_id;
+        if (task->sort_task) {
+            running_sorts--;
+            group_runs.insert(group_runs.end(),
+                std::make_move_iterator(task->sort_task->run_files.begin()),
+                std::make_move_iterator(task->sort_task->run_files.end()));
+            bool all_sorted = next_chunk + 1 >= bounds.size() && running_sorts == 0;
+            if (++group_sorted == group_chunks || all_sorted)
+                close_group();
+            delete task->sort_task;
         } else if (task->merge_task) {
-            merge_count++;
+            running_merges--;
             merge_files.push_back(std::move(task->merge_task->output));
-            auto all_finished = std::all_of(
-                submitted_sort_tasks.begin(), submitted_sort_tasks.end(),
-                [](const auto& count) { return count == 0; });
-            if (merge_count == expected_merges && all_finished) {
-                kWayMergeFiles(merge_files, output_file, MAX_MEMORY);
-                delete task->merge_task;
-                delete task;
-                return EOS;
-            }
-
             delete task->merge_task;
-            delete task;
-            return GO_ON;
+        }
+        delete task;
+
+        dispatch(w);
+        /* A merge that just became ready may go to a worker that was waiting */
+        while (!ready_merges.empty() && !idle_workers.empty()) {
+            const size_t idle = idle_workers.back();
+            idle_workers.pop_back();
+            dispatch(idle);
         }
 
+        if (running_sorts > 0 || running_merges > 0 || !ready_merges.empty() || next_chunk + 1 < bounds.size())
+            return GO_ON;
+        /* The workers are idle by now, the final merge is split among all the threads */
+        partitionedMergeFiles(merge_files, output_file, MAX_MEMORY, NTHREADS, OUTPUT_DURABILITY);
         return EOS;
     }
 };
@@ -207,7 +176,8 @@ struct WorkerNode : ff::ff_node_t<work_t> {
                 work->sort_task->memory,
                 run_prefix + generateUUID());
         else if (work->merge_task)
-            kWayMergeFiles(work->merge_task->files, work->merge_task->output, work->merge_task->memory);
+            kWayMergeFiles(work->merge_task->files, work->merge_task->output, work->merge_task->memory,
+                           Durability::None, true);
 
         ff_send_out(work);
         return GO_ON;
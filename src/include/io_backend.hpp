@@ -0,0 +1,394 @@
+#ifndef _IO_BACKEND_HPP
+#define _IO_BACKEND_HPP
+
+#include "config.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <iostream>
+#include <linux/io_uring.h>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+/* Requests a single read of a merge input window is split into */
+static constexpr size_t IO_QUEUE_DEPTH = 8;
+/* Entries of the submission queue, the completion queue is twice as big */
+static constexpr unsigned int IO_RING_ENTRIES = 256;
+/* Largest transfer of a single submission, the length field of an SQE is 32 bits */
+static constexpr size_t IO_MAX_TRANSFER = 1UL << 30;
+
+/* Alignment of the buffers, file offsets and lengths of direct I/O */
+static constexpr size_t DIRECT_IO_ALIGNMENT = 4096;
+
+static inline size_t alignDown(size_t n) { return n & ~(DIRECT_IO_ALIGNMENT - 1); }
+static inline size_t alignUp(size_t n) { return alignDown(n + DIRECT_IO_ALIGNMENT - 1); }
+
+struct IoBufferDelete {
+    void operator()(char* p) const { ::operator delete[](p, std::align_val_t(DIRECT_IO_ALIGNMENT)); }
+};
+
+/* Buffer that can be the source or the target of direct I/O */
+using IoBufferPtr = std::unique_ptr<char[], IoBufferDelete>;
+
+static inline IoBufferPtr allocIoBuffer(size_t bytes) {
+    return IoBufferPtr(static_cast<char*>(::operator new[](bytes, std::align_val_t(DIRECT_IO_ALIGNMENT))));
+}
+
+/* Allocator of vectors whose data can be the source or the target of direct I/O */
+template<typename T>
+struct IoAllocator {
+    using value_type = T;
+
+    IoAllocator() = default;
+    template<typename U> IoAllocator(const IoAllocator<U>&) {}
+
+    T* allocate(size_t n) {
+        return static_cast<T*>(::operator new[](n * sizeof(T), std::align_val_t(DIRECT_IO_ALIGNMENT)));
+    }
+    void deallocate(T* p, size_t) { ::operator delete[](p, std::align_val_t(DIRECT_IO_ALIGNMENT)); }
+
+    template<typename U> bool operator == (const IoAllocator<U>&) const { return true; }
+    template<typename U> bool operator != (const IoAllocator<U>&) const { return false; }
+};
+
+using IoBuffer = std::vector<char, IoAllocator<char>>;
+
+/**
+ * Switch fd to direct I/O, bypassing the page cache.
+ * If the file system does not support it, a warning is printed once and false is returned.
+ */
+static bool enableDirectIO(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags >= 0 && fcntl(fd, F_SETFL, flags | O_DIRECT) == 0)
+        return true;
+
+    static std::atomic<bool> warned{false};
+    if (!warned.exchange(true))
+        std::cerr << "Direct I/O is not supported (" << strerror(errno) << "), using the page cache" << std::endl;
+    return false;
+}
+
+/**
+ * A positioned read or write handled by an IoBackend.
+ * The request and its buffer belong to the caller and must stay alive until it completes.
+ * Both backends transfer the whole length unless the end of the file is reached first.
+ */
+struct IoRequest {
+    int fd = -1;
+    char* buf = nullptr;
+    size_t len = 0;
+    off_t offset = 0;
+    bool write = false;
+    int buf_index = -1;   // Index of the registered buffer containing buf, -1 if none
+    size_t done = 0;      // Bytes transferred so far
+    bool complete = true; // No transfer in flight
+};
+
+/**
+ * Interface of the asynchronous I/O used by the merges: requests are queued, then
+ * submitted in a batch, and their completions are reaped one at a time with wait().
+ */
+struct IoBackend {
+    virtual ~IoBackend() = default;
+
+    /* Queue a request, it is guaranteed to reach the kernel only after submit() */
+    virtual void queue(IoRequest* req) = 0;
+    /* Submit all the queued requests */
+    virtual void submit() = 0;
+    /* Wait for the next completed request, which is marked as complete */
+    virtual IoRequest* wait() = 0;
+    /* Register buffers once, request i into buffers[i] can then set buf_index = i */
+    virtual bool registerBuffers(const std::vector<iovec>&) { return false; }
+
+    /* Wait until req is complete, the other completions reaped meanwhile are only marked */
+    void waitFor(IoRequest* req) {
+        while (!req->complete) wait();
+    }
+};
+
+/* Serve a request with pread/pwrite, until all its bytes are transferred or EOF */
+static void transferRequest(IoRequest* req) {
+    while (req->done < req->len) {
+        ssize_t n = req->write
+            ? pwrite(req->fd, req->buf + req->done, req->len - req->done, req->offset + req->done)
+            : pread(req->fd, req->buf + req->done, req->len - req->done, req->offset + req->done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            std::cerr << (req->write ? "pwrite" : "pread") << " failed: " << strerror(errno) << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        if (n == 0) break; // EOF
+        req->done += n;
+    }
+}
+
+/**
+ * Backend with a single I/O thread serving the requests with pread/pwrite in order,
+ * so that they run in the background like the ones of a ring. It is the fallback
+ * when io_uring is not requested or not available, one per merge or RunWriter.
+ */
+struct ThreadBackend : IoBackend {
+    std::deque<IoRequest*> queued;  // Only touched by the owner thread
+    std::deque<IoRequest*> pending, completed;
+    size_t in_flight = 0;
+    bool stop = false;
+    std::mutex mutex;
+    std::condition_variable work_ready, work_done;
+    std::thread worker;
+
+    ThreadBackend() : worker([this] { serve(); }) {}
+
+    ~ThreadBackend() override {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        work_ready.notify_one();
+        worker.join();
+    }
+
+    void queue(IoRequest* req) override {
+        req->complete = false;
+        req->done = 0;
+        queued.push_back(req);
+    }
+
+    void submit() override {
+        if (queued.empty()) return;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            pending.insert(pending.end(), queued.begin(), queued.end());
+            in_flight += queued.size();
+        }
+        queued.clear();
+        work_ready.notify_one();
+    }
+
+    IoRequest* wait() override {
+        submit();
+        std::unique_lock<std::mutex> lock(mutex);
+        if (in_flight == 0) {
+            std::cerr << "wait called with no request in flight" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        work_done.wait(lock, [this] { return !completed.empty(); });
+        IoRequest* req = completed.front();
+        completed.pop_front();
+        in_flight--;
+        req->complete = true;
+        return req;
+    }
+
+    void serve() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            work_ready.wait(lock, [this] { return stop || !pending.empty(); });
+            if (pending.empty()) return;
+            IoRequest* req = pending.front();
+            pending.pop_front();
+            lock.unlock();
+            transferRequest(req);
+            lock.lock();
+            completed.push_back(req);
+            work_done.notify_one();
+        }
+    }
+};
+
+/**
+ * io_uring backend driven with the raw system calls, so that no library is needed.
+ * Requests are written to the submission ring by queue() and handed to the kernel with
+ * a single io_uring_enter by submit(), so many reads and writes can be in flight at once.
+ * Short transfers are resubmitted for the remaining bytes until EOF.
+ */
+struct UringBackend : IoBackend {
+    int ring_fd = -1;
+    void* sq_ptr = nullptr;
+    void* cq_ptr = nullptr;
+    size_t sq_len = 0, cq_len = 0, sqes_len = 0;
+    unsigned int *sq_head = nullptr, *sq_tail = nullptr, *sq_array = nullptr;
+    unsigned int *cq_head = nullptr, *cq_tail = nullptr;
+    unsigned int sq_mask = 0, cq_mask = 0, sq_entries = 0;
+    io_uring_sqe* sqes = nullptr;
+    io_uring_cqe* cqes = nullptr;
+    unsigned int to_submit = 0;
+    bool registered = false;
+
+    UringBackend(const UringBackend&) = delete;
+    UringBackend& operator=(const UringBackend&) = delete;
+
+    /* Create the ring, valid() is false if the kernel does not allow it */
+    UringBackend() {
+        io_uring_params params;
+        std::memset(&params, 0, sizeof(params));
+        ring_fd = syscall(__NR_io_uring_setup, IO_RING_ENTRIES, &params);
+        if (ring_fd < 0) return;
+
+        sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+        cq_len = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_mmap) sq_len = cq_len = std::max(sq_len, cq_len);
+
+        sq_ptr = mmap(nullptr, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+        cq_ptr = single_mmap ? sq_ptr
+                             : mmap(nullptr, cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        sqes_len = params.sq_entries * sizeof(io_uring_sqe);
+        void* sqes_ptr = mmap(nullptr, sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+        if (sq_ptr == MAP_FAILED || cq_ptr == MAP_FAILED || sqes_ptr == MAP_FAILED) {
+            std::cerr << "io_uring mmap failed: " << strerror(errno) << std::endl;
+            exit(EXIT_FAILURE);
+        }
+
+        char* sq = static_cast<char*>(sq_ptr);
+        sq_head = reinterpret_cast<unsigned int*>(sq + params.sq_off.head);
+        sq_tail = reinterpret_cast<unsigned int*>(sq + params.sq_off.tail);
+        sq_mask = *reinterpret_cast<unsigned int*>(sq + params.sq_off.ring_mask);
+        sq_array = reinterpret_cast<unsigned int*>(sq + params.sq_off.array);
+        sq_entries = params.sq_entries;
+        sqes = static_cast<io_uring_sqe*>(sqes_ptr);
+
+        char* cq = static_cast<char*>(cq_ptr);
+        cq_head = reinterpret_cast<unsigned int*>(cq + params.cq_off.head);
+        cq_tail = reinterpret_cast<unsigned int*>(cq + params.cq_off.tail);
+        cq_mask = *reinterpret_cast<unsigned int*>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+    }
+
+    ~UringBackend() override {
+        if (ring_fd < 0) return;
+        munmap(sqes, sqes_len);
+        if (cq_ptr != sq_ptr) munmap(cq_ptr, cq_len);
+        munmap(sq_ptr, sq_len);
+        close(ring_fd);
+    }
+
+    bool valid() const { return ring_fd >= 0; }
+
+    bool registerBuffers(const std::vector<iovec>& buffers) override {
+        if (registered || buffers.empty()) return false;
+        registered = syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_BUFFERS,
+                             buffers.data(), static_cast<unsigned int>(buffers.size())) == 0;
+        return registered;
+    }
+
+    /* Write the SQE for the bytes of req that are still to be transferred */
+    void queueRemaining(IoRequest* req) {
+        unsigned int tail = *sq_tail;
+        if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) == sq_entries) {
+            submit();
+            tail = *sq_tail;
+        }
+
+        unsigned int index = tail & sq_mask;
+        io_uring_sqe* sqe = &sqes[index];
+        std::memset(sqe, 0, sizeof(*sqe));
+        bool fixed = req->buf_index >= 0;
+        if (req->write)
+            sqe->opcode = fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+        else
+            sqe->opcode = fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+        if (fixed) sqe->buf_index = req->buf_index;
+        sqe->fd = req->fd;
+        sqe->addr = reinterpret_cast<uint64_t>(req->buf + req->done);
+        sqe->len = static_cast<uint32_t>(std::min(req->len - req->done, IO_MAX_TRANSFER));
+        sqe->off = req->offset + req->done;
+        sqe->user_data = reinterpret_cast<uint64_t>(req);
+
+        sq_array[index] = index;
+        __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+        to_submit++;
+    }
+
+    void queue(IoRequest* req) override {
+        req->complete = false;
+        req->done = 0;
+        queueRemaining(req);
+    }
+
+    /* Submit the queued requests, optionally waiting for min_complete completions */
+    void enter(unsigned int min_complete) {
+        while (true) {
+            unsigned int flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+            int ret = syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, nullptr, 0);
+            if (ret < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+            if (ret < 0) {
+                std::cerr << "io_uring_enter failed: " << strerror(errno) << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            to_submit -= std::min<unsigned int>(ret, to_submit);
+            if (to_submit == 0) return;
+        }
+    }
+
+    void submit() override {
+        if (to_submit) enter(0);
+    }
+
+    IoRequest* wait() override {
+        while (true) {
+            unsigned int head = *cq_head;
+            if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+                enter(1);
+                continue;
+            }
+
+            io_uring_cqe* cqe = &cqes[head & cq_mask];
+            IoRequest* req = reinterpret_cast<IoRequest*>(cqe->user_data);
+            int res = cqe->res;
+            __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+
+            if (res == -EINTR || res == -EAGAIN) {
+                queueRemaining(req);
+                submit();
+                continue;
+            }
+            if (res < 0) {
+                std::cerr << "io_uring " << (req->write ? "write" : "read") << " failed: " << strerror(-res) << std::endl;
+                exit(EXIT_FAILURE);
+            }
+
+            req->done += res;
+            if (res > 0 && req->done < req->len) {
+                /* Short transfer, ask for the rest */
+                queueRemaining(req);
+                submit();
+                continue;
+            }
+            req->complete = true;
+            return req;
+        }
+    }
+};
+
+/**
+ * The backend of the runs and of the merges: nullptr (the inputs are mapped and each
+ * RunWriter writes with its own I/O thread) unless IO_URING or DIRECT_IO is set.
+ * Direct I/O alone, or a kernel that refuses to create a ring, gets the threaded backend.
+ */
+static std::unique_ptr<IoBackend> makeIoBackend() {
+    if (!IO_URING && !DIRECT_IO) return nullptr;
+    if (!IO_URING) return std::make_unique<ThreadBackend>();
+
+    auto uring = std::make_unique<UringBackend>();
+    if (uring->valid()) return uring;
+
+    static std::atomic<bool> warned{false};
+    if (!warned.exchange(true))
+        std::cerr << "io_uring is not available (" << strerror(errno) << "), using pread/pwrite" << std::endl;
+    return std::make_unique<ThreadBackend>();
+}
+
+#endif // _IO_BACKEND_HPP
@@ -0,0 +1,95 @@
+#ifndef _LOSER_TREE_HPP
+#define _LOSER_TREE_HPP
+
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+/**
+ * Tournament tree of losers for k-way merging.
+ * Only the key of the current record of each source and the source index are stored,
+ * in a flat cache-aligned array: node 0 holds the overall winner and every internal
+ * node the loser of the match played there. Replacing the winner replays the single
+ * path from its leaf to the root, that is log2(k) comparisons and no pop/push pair.
+ */
+struct LoserTree {
+    struct Node {
+        unsigned long key;
+        uint32_t source;
+        uint32_t done; // The source has no more records, it loses against everything
+    };
+
+    struct AlignedDelete {
+        void operator()(Node* p) const { ::operator delete[](p, std::align_val_t(64)); }
+    };
+
+    size_t capacity = 1; // Number of leaves, rounded up to a power of two
+    std::unique_ptr<Node[], AlignedDelete> nodes;
+
+    static bool beats(const Node& a, const Node& b) {
+        return a.done < b.done || (a.done == b.done && a.key < b.key);
+    }
+
+    /**
+     * Build the tree from the first key of every source.
+     *
+     * @param keys The first key of each source.
+     * @param done Whether each source is already empty.
+     */
+    void init(const std::vector<unsigned long>& keys, const std::vector<bool>& done) {
+        size_t k = keys.size();
+        capacity = 1;
+        while (capacity < k) capacity <<= 1;
+        nodes.reset(static_cast<Node*>(::operator new[](capacity * sizeof(Node), std::align_val_t(64))));
+
+        /* Winners of every subtree, the leaves are at [capacity, 2 * capacity) */
+        std::vector<Node> winners(2 * capacity);
+        for (size_t i = 0; i < capacity; i++) {
+            bool leaf_done = i >= k || done[i];
+            winners[capacity + i] = {leaf_done ? 0 : keys[i], static_cast<uint32_t>(i), leaf_done};
+        }
+        for (size_t n = capacity - 1; n >= 1; n--) {
+            const Node& l = winners[2 * n];
+            const Node& r = winners[2 * n + 1];
+            bool left_wins = !beats(r, l);
+            winners[n] = left_wins ? l : r;
+            nodes[n] = left_wins ? r : l;
+        }
+        nodes[0] = winners[1];
+    }
+
+    bool empty() const { return nodes[0].done; }
+    size_t winner() const { return nodes[0].source; }
+    unsigned long winnerKey() const { return nodes[0].key; }
+
+    /**
+     * Key of the best source other than the winner, ULONG_MAX if they are all done.
+     * The runner-up only lost against the winner, so it is one of the losers on its path.
+     */
+    unsigned long runnerUpKey() const {
+        Node best = {0, 0, 1};
+        for (size_t n = (capacity + nodes[0].source) / 2; n >= 1; n /= 2)
+            if (beats(nodes[n], best)) best = nodes[n];
+        return best.done ? ULONG_MAX : best.key;
+    }
+
+    /* Replace the winner with the next key of its source and replay its path */
+    void replay(unsigned long key) { replay({key, nodes[0].source, 0}); }
+
+    /* The winner source has no more records */
+    void exhaust() { replay({0, nodes[0].source, 1}); }
+
+    void replay(Node candidate) {
+        for (size_t n = (capacity + candidate.source) / 2; n >= 1; n /= 2) {
+            if (beats(nodes[n], candidate))
+                std::swap(nodes[n], candidate);
+        }
+        nodes[0] = candidate;
+    }
+};
+
+#endif // _LOSER_TREE_HPP
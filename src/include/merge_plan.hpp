@@ -0,0 +1,86 @@
+#ifndef _MERGE_PLAN_HPP
+#define _MERGE_PLAN_HPP
+
+#include "config.hpp"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <queue>
+#include <sys/resource.h>
+#include <utility>
+#include <vector>
+
+/* Descriptors left to everything but the inputs of the merges: output, backends, MPI, ... */
+static constexpr size_t MERGE_RESERVED_FILES = 64;
+
+/* Files a process may open for the inputs of its merges, from its soft limit */
+static size_t openFileBudget() {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) != 0 || limit.rlim_cur == RLIM_INFINITY)
+        return SIZE_MAX;
+    return std::max<size_t>(limit.rlim_cur, 2 * MERGE_RESERVED_FILES) - MERGE_RESERVED_FILES;
+}
+
+/**
+ * Largest number of inputs a merge with max_mem bytes can take: each one needs a window
+ * of at least MERGE_MIN_READ bytes, after the third of the memory of the output buffers,
+ * and a descriptor out of open_files. A merge takes at least 2 inputs anyway.
+ */
+static size_t mergeFanIn(size_t max_mem, size_t open_files) {
+    const size_t windows = (max_mem - max_mem / 3) / std::max<size_t>(MERGE_MIN_READ, 1);
+    return std::max<size_t>(2, std::min(windows, open_files));
+}
+
+/**
+ * Merges turning runs into a single file. The nodes of the tree are numbered with the
+ * runs first, 0 to runs - 1, then the output of step s is node runs + s. Every step
+ * comes after the ones whose outputs it merges, the last one makes the final file.
+ */
+struct MergeStep {
+    std::vector<size_t> inputs;
+    size_t bytes = 0;
+};
+
+struct MergePlan {
+    size_t runs = 0;
+    std::vector<MergeStep> steps;
+
+    bool isRun(size_t node) const { return node < runs; }
+};
+
+/**
+ * Optimal merge pattern of runs of the given sizes with merges of up to fan_in inputs,
+ * the k-ary Huffman tree: the smallest files are merged first, so the big ones are
+ * rewritten by as few passes as possible and the bytes written are the fewest.
+ * Only the first merge takes fewer than fan_in inputs, the ones that do not divide
+ * evenly, so that every later merge, the final one above all, is full.
+ */
+static MergePlan planMerges(const std::vector<size_t>& sizes, size_t fan_in) {
+    MergePlan plan;
+    plan.runs = sizes.size();
+    fan_in = std::max<size_t>(fan_in, 2);
+
+    using Node = std::pair<size_t, size_t>; // Bytes, node
+    std::priority_queue<Node, std::vector<Node>, std::greater<Node>> smallest;
+    for (size_t i = 0; i < sizes.size(); i++)
+        smallest.push({sizes[i], i});
+
+    size_t take = fan_in;
+    if (sizes.size() > fan_in)
+        take = (sizes.size() - 2) % (fan_in - 1) + 2;
+    while (smallest.size() > 1) {
+        MergeStep step;
+        for (size_t i = 0; i < take && !smallest.empty(); i++) {
+            step.bytes += smallest.top().first;
+            step.inputs.push_back(smallest.top().second);
+            smallest.pop();
+        }
+        smallest.push({step.bytes, plan.runs + plan.steps.size()});
+        plan.steps.push_back(std::move(step));
+        take = fan_in;
+    }
+    return plan;
+}
+
+#endif // _MERGE_PLAN_HPP
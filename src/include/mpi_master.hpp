@@ -4,7 +4,10 @@
 #include "common.hpp"
 #include "config.hpp"
 #include "omp_sort.hpp"
+#include "record_boundaries.hpp"
+#include "run_reader.hpp"
 #include <atomic>
+#include <climits>
 #include <cstdint>
 #include <cstdlib>
 #include <cstring>
@@ -25,53 +28,30 @@ static void master(const std::string& filename, int world_size) {
 
     const unsigned int num_workers = world_size - 1;
 
-    size_t worker_idx = 0;
-    std::vector<char> buffer(MAX_MEMORY);
-    size_t bytes_in_buffer = 0;
-    size_t buffer_offset = 0;
-
-    std::vector<std::vector<char>> node_chunks(num_workers);
-    while (true) {
-        if (buffer_offset < bytes_in_buffer) {
-            memmove(buffer.data(), buffer.data() + buffer_offset, bytes_in_buffer - buffer_offset);
-            bytes_in_buffer -= buffer_offset;
-        } else {
-            bytes_in_buffer = 0;
-        }
-        buffer_offset = 0;
-
-        ssize_t bytes_read = read(fd, buffer.data() + bytes_in_buffer, buffer.size() - bytes_in_buffer);
-
-        if (bytes_read <= 0 && bytes_in_buffer == 0) break;
-        if (bytes_read > 0) bytes_in_buffer += bytes_read;
-
-        while (buffer_offset + sizeof(uint64_t) + sizeof(uint32_t) <= bytes_in_buffer) {
-            size_t rec_start = buffer_offset;
-            buffer_offset += sizeof(uint64_t);
-            uint32_t len = *reinterpret_cast<uint32_t*>(&buffer[buffer_offset]);
-            buffer_offset += sizeof(uint32_t);
-
-            if (buffer_offset + len > bytes_in_buffer) {
-                buffer_offset = rec_start;
-                break;
+    /**
+     * Every round sends each worker a chunk of whole records of about MAX_MEMORY / num_workers
+     * bytes (see findChunkBounds), less if that would not leave the longest records room under
+     * the int count of a message. The chunks are sent straight from the mapping of the input,
+     * without copies.
+     */
+    const size_t chunk_target = std::min<size_t>(MAX_MEMORY / num_workers, INT_MAX / 2);
+    std::vector<size_t> bounds = findChunkBounds(filename, chunk_target, NTHREADS);
+    RunReader reader(fd);
+    for (size_t first = 0; first + 1 < bounds.size(); first += num_workers) {
+        size_t last = std::min<size_t>(first + num_workers, bounds.size() - 1);
+        const char* data = reader.view(bounds[first], bounds[last] - bounds[first]);
+
+        /* Send to workers. Starting from 1 because rank 0 is the master, a size of 0 would mean EOS */
+        for (unsigned int node = 1; node <= last - first; node++) {
+            size_t chunk = first + node - 1;
+            const size_t chunk_bytes = bounds[chunk + 1] - bounds[chunk];
+            if (chunk_bytes > INT_MAX) {
+                std::cerr << "A chunk of " << chunk_bytes << " bytes does not fit in a message, a record is too long" << std::endl;
+                exit(EXIT_FAILURE);
             }
-
-            size_t rec_size = sizeof(uint64_t) + sizeof(uint32_t) + len;
-            std::vector<char> rec(rec_size);
-            std::memcpy(rec.data(), &buffer[rec_start], rec_size);
-            node_chunks[worker_idx].insert(node_chunks[worker_idx].end(), rec.begin(), rec.end());
-            worker_idx = (worker_idx + 1) % num_workers;
-            buffer_offset += len;
-        }
-
-        /* Send to workers. Starting from 1 because rank 0 is the master */
-        for (unsigned int node = 1; node <= num_workers; node++) {
-            int chunk_size = (int)node_chunks[node-1].size();
+            int chunk_size = static_cast<int>(chunk_bytes);
             MPI_Send(&chunk_size, 1, MPI_INT, node, 0, MPI_COMM_WORLD);
-            if (chunk_size > 0)
-                MPI_Send(node_chunks[node-1].data(), node_chunks[node-1].size(), MPI_CHAR, node, 0, MPI_COMM_WORLD);
-
-            node_chunks[node-1].clear();
+            MPI_Send(data + (bounds[chunk] - bounds[first]), chunk_size, MPI_CHAR, node, 0, MPI_COMM_WORLD);
         }
     }
     close(fd);
@@ -91,7 +71,7 @@ static void master(const std::string& filename, int world_size) {
     #pragma omp parallel num_threads(n_threads)
     {
         int src = omp_get_thread_num() + 1;
-        std::string fname = run_prefix + std::to_string(src);
+        std::string fname = scratchPath(run_prefix + std::to_string(src));
         #pragma omp critical
         {
             sequences.push_back(fname);
@@ -117,7 +97,7 @@ static void master(const std::string& filename, int world_size) {
 
     /* Only the master node access the disk and merges the sorted chunks */
     omp_set_num_threads(NTHREADS);
-    ompMerge(sequences, merge_prefix, output_file);
+    ompMerge(sequences, merge_prefix, output_file, OUTPUT_DURABILITY);
 }
 
 #endif // _MPI_MASTER_HPP
@@ -19,9 +19,9 @@
 
 static void worker(std::string tmp_location, size_t world_size) {
     int fd = 0, done = 0;
-    size_t accumulated_size = 0, read_size = 0, offset = 0;
+    size_t accumulated_size = 0, read_size = 0;
     int size = 0;
-    std::vector<Record> records;
+    RecordChunk records;
     /**
      * The master receives the sequences concurrently from all the workers so to respect
      * memory constraints we can send up to The total memory divided by the number of workers minus the master
@@ -37,6 +37,8 @@ static void worker(std::string tmp_location, size_t world_size) {
     std::string merge_prefix = tmp_path.string() + "/merge#";
     std::string output_file = tmp_path.string() + "/output.dat";
     std::vector<std::string> sequences;
+    /* The slab is allocated once and reused for every run */
+    records.reserve(MAX_MEMORY);
     while (true) {
         MPI_Recv(&size, 1, MPI_INT, 0, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
         if (size == 0) break;
@@ -44,43 +46,60 @@ static void worker(std::string tmp_location, size_t world_size) {
         std::vector<char> buf(size);
         MPI_Recv(buf.data(), size, MPI_CHAR, 0, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
 
-        offset = 0;
-        while (offset + sizeof(uint64_t) + sizeof(uint32_t) <= buf.size()) {
-            uint64_t key = *reinterpret_cast<uint64_t*>(&buf[offset]);
-            offset += sizeof(uint64_t);
-            uint32_t len = *reinterpret_cast<uint32_t*>(&buf[offset]);
-            offset += sizeof(uint32_t);
-
-            if (offset + len > buf.size()) break;
-
-            Record rec;
-            rec.key = key;
-            rec.len = len;
-            rec.rpayload = std::make_unique<char[]>(len);
-            std::memcpy(rec.rpayload.get(), &buf[offset], len);
-            offset += len;
-            records.push_back(std::move(rec));
-            accumulated_size += sizeof(uint64_t) + sizeof(uint32_t) + len;
-        }
-
-        /* Flush the records when the memory limit is reached */
-         if (accumulated_size >= MAX_MEMORY) {
-            std::string file = run_prefix + generateUUID();
+        /* Flush the records when the memory limit would be exceeded, counting their tags and the sort scratch */
+        if (!records.empty() && !fitsInMemory(records.bytes() + buf.size(), records.size() + estimatedRecords(buf.size()))) {
+            std::string file = runFileName(run_prefix + generateUUID(), RUN_TIER);
             sequences.push_back(file);
             int fd = openFile(file);
-            std::sort(records.begin(), records.end(), RecordComparator{});
-            appendToFile(fd, std::move(records), accumulated_size); // This empties the heap
+            sortChunk(records, NTHREADS);
+            writeRun(fd, records, nullptr, MAX_MEMORY / 9, Durability::None, file); // This empties the chunk
             close(fd);
             accumulated_size = 0;
         }
+
+        /* Messages from the master only contain whole records */
+        if (RECORD_STRIDE)
+            accumulated_size += records.appendRecords(buf.data(), buf.size(), buf.size(), FixedLayout{RECORD_STRIDE});
+        else
+            accumulated_size += records.appendRecords(buf.data(), buf.size(), buf.size());
+    }
+
+    /* The whole share fitted in memory: send it back sorted without touching the disk */
+    if (sequences.empty() && fitsInMemory(records.bytes(), records.size())) {
+        sortChunk(records, NTHREADS);
+        size_t send_size = 0;
+        auto sendBuffer = [&]() {
+            int message_size = send_size;
+            MPI_Send(&message_size, 1, MPI_INT, 0, 1, MPI_COMM_WORLD);
+            MPI_Send(send_buf.data(), message_size, MPI_CHAR, 0, 1, MPI_COMM_WORLD);
+            send_size = 0;
+        };
+        /* Messages may split records, the master just appends them to the run file */
+        for (const auto& tag : records.tags) {
+            const char* record = records.record(tag);
+            size_t record_size = records.recordSize(tag);
+            while (record_size > 0) {
+                size_t n = std::min(record_size, send_buf_size - send_size);
+                memcpy(send_buf.data() + send_size, record, n);
+                send_size += n;
+                record += n;
+                record_size -= n;
+                if (send_size == send_buf_size) sendBuffer();
+            }
+        }
+        if (send_size > 0) sendBuffer();
+
+        MPI_Send(&done, 1, MPI_INT, 0, 1, MPI_COMM_WORLD);
+        std::filesystem::remove_all(tmp_path);
+        return;
     }
 
     if (!records.empty()) {
-        std::string file = run_prefix + generateUUID();
+        std::string file = runFileName(run_prefix + generateUUID(), RUN_TIER);
         sequences.push_back(file);
         int fd = openFile(file);
-        std::sort(records.begin(), records.end(), RecordComparator{});
-        appendToFile(fd, std::move(records), accumulated_size);
+        sortChunk(records, NTHREADS);
+        writeRun(fd, records, nullptr, MAX_MEMORY / 9, Durability::None, file);
         close(fd);
         accumulated_size = 0;
     }
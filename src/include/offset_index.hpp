@@ -0,0 +1,107 @@
+#ifndef _OFFSET_INDEX_HPP
+#define _OFFSET_INDEX_HPP
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+/**
+ * Sparse index of the record offsets of a data file, stored next to it in a sidecar
+ * file with the same name and OFFSET_INDEX_SUFFIX. gen_file writes one, and the sorters
+ * use it, when present and up to date, to chunk the input without scanning it.
+ * The sorters also index their plain temporary runs, to cut the final merge into
+ * key ranges (see partitioned_merge.hpp).
+ *
+ * Format, every field is a little endian uint64_t:
+ *   magic      OFFSET_INDEX_MAGIC
+ *   data_size  Size of the data file, the index is ignored if the file has a different one
+ *   interval   Bytes between two entries the producer aimed at, only informative
+ *   count      Number of entries
+ *   offsets    count offsets of record starts, strictly increasing, the first one is 0
+ * The entries need not be evenly spaced, and the data file must end with a whole record.
+ */
+static constexpr const char* OFFSET_INDEX_SUFFIX = ".idx";
+static constexpr uint64_t OFFSET_INDEX_MAGIC = 0x58444946464f534dULL; // "MSOFFIDX"
+/* Bytes between two entries of the indices written by gen_file */
+static constexpr uint64_t OFFSET_INDEX_INTERVAL = 1UL << 20;
+/* Bytes between two entries of the indices of the temporary runs, where a partitioned merge looks for its cuts */
+static constexpr uint64_t RUN_INDEX_INTERVAL = 64UL << 10;
+
+struct OffsetIndexHeader {
+    uint64_t magic;
+    uint64_t data_size;
+    uint64_t interval;
+    uint64_t count;
+};
+
+static std::string offsetIndexName(const std::string& data_filename) {
+    return data_filename + OFFSET_INDEX_SUFFIX;
+}
+
+/* Index of a data file built while its records are written, one entry every interval bytes */
+struct OffsetIndexBuilder {
+    std::vector<uint64_t> offsets;
+    uint64_t interval;
+    uint64_t data_size = 0;
+
+    explicit OffsetIndexBuilder(uint64_t interval = OFFSET_INDEX_INTERVAL) : interval(interval) {}
+
+    /* Account for the next record written, of record_size bytes */
+    void add(size_t record_size) {
+        if (offsets.empty() || data_size >= offsets.back() + interval)
+            offsets.push_back(data_size);
+        data_size += record_size;
+    }
+
+    /* Write the sidecar file of data_filename */
+    void write(const std::string& data_filename) const {
+        const std::string name = offsetIndexName(data_filename);
+        int fd = open(name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        OffsetIndexHeader header = {OFFSET_INDEX_MAGIC, data_size, interval, offsets.size()};
+        const size_t bytes = offsets.size() * sizeof(uint64_t);
+        if (fd < 0
+            || ::write(fd, &header, sizeof(header)) != sizeof(header)
+            || ::write(fd, offsets.data(), bytes) != static_cast<ssize_t>(bytes)) {
+            std::cerr << "Error writing the offset index " << name << ": " << strerror(errno) << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        close(fd);
+    }
+};
+
+/**
+ * Read the sidecar index of a data file of data_size bytes.
+ *
+ * @return Whether there is a valid index for the file, a stale or malformed one is ignored.
+ */
+static bool readOffsetIndex(const std::string& data_filename, size_t data_size, std::vector<size_t>& offsets) {
+    const std::string name = offsetIndexName(data_filename);
+    int fd = open(name.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+
+    OffsetIndexHeader header;
+    bool valid = read(fd, &header, sizeof(header)) == sizeof(header)
+        && header.magic == OFFSET_INDEX_MAGIC && header.data_size == data_size
+        && header.count > 0 && header.count <= data_size;
+    if (valid) {
+        std::vector<uint64_t> entries(header.count);
+        const size_t bytes = entries.size() * sizeof(uint64_t);
+        valid = read(fd, entries.data(), bytes) == static_cast<ssize_t>(bytes) && entries[0] == 0;
+        for (size_t i = 1; valid && i < entries.size(); i++)
+            valid = entries[i] > entries[i - 1] && entries[i] < data_size;
+        if (valid) offsets.assign(entries.begin(), entries.end());
+    }
+    close(fd);
+    if (!valid)
+        std::cerr << "Ignoring the offset index " << name << ", it does not match the file" << std::endl;
+    return valid;
+}
+
+#endif // _OFFSET_INDEX_HPP
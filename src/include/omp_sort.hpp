@@ -3,180 +3,140 @@
 
 #include "common.hpp"
 #include "config.hpp"
+#include "merge_plan.hpp"
+#include "partitioned_merge.hpp"
+#include "record_boundaries.hpp"
 #include "sorting.hpp"
 #include <cstddef>
 #include <filesystem>
+#include <functional>
 #include <omp.h>
 #include <string>
 #include <vector>
 
 
-static std::vector<std::string> genRuns(const std::string& filename, const std::string& run_prefix) {
+/**
+ * Generate the sorted runs of the file with a task per chunk, merging them as they
+ * come: the runs are kept by level, the ones of the chunks at level 0 and the output
+ * of a merge one level above its inputs, so the runs of a level are about the same
+ * size. As soon as a level has as many runs as a merge of a thread can take (see
+ * mergeFanIn), the task that completed it merges them before its thread picks the
+ * next chunk, and the merge may complete the level above in turn. When the last chunk
+ * is sorted, the merges left to ompMerge start from fewer, larger runs.
+ *
+ * @return The runs left, of any level.
+ */
+static std::vector<std::string> genRuns(const std::string& filename, const std::string& run_prefix,
+                                        const std::string& merge_prefix) {
     size_t file_size = getFileSize(filename);
     size_t max_mem_per_worker = MAX_MEMORY / NTHREADS;
     size_t chunk_size = std::min(file_size / 100, 3 * max_mem_per_worker); // 1% of the file or the memory per worker to keep them busy
-    int fd = open(filename.c_str(), O_RDONLY);
-    if (fd < 0) {
-        std::cerr << "Error opening file: " << strerror(errno) << std::endl;
-        exit(EXIT_FAILURE);
-    }
-
-    std::vector<char> buffer(max_mem_per_worker);
-    size_t buffer_offset = 0;
-    size_t file_offset = 0;
-
-    size_t start_offset = 0;
-    size_t end_offset = 0;
+    const size_t fan_in = mergeFanIn(max_mem_per_worker, openFileBudget() / NTHREADS);
+    std::vector<std::vector<std::string>> levels;
+
+    /* Add runs to a level, then merge it if it is full, and the levels above that fill up */
+    auto addRuns = [&](std::vector<std::string> runs, size_t level) {
+        while (true) {
+            std::vector<std::string> group;
+            #pragma omp critical(run_levels)
+            {
+                if (levels.size() <= level) levels.resize(level + 1);
+                for (auto& run : runs)
+                    if (!run.empty()) levels[level].push_back(std::move(run));
+                if (levels[level].size() >= fan_in)
+                    group.swap(levels[level]);
+            }
+            if (group.empty()) return;
+            std::string merged = runFileName(merge_prefix + generateUUID(), MERGE_TIER);
+            kWayMergeFiles(group, merged, max_mem_per_worker, Durability::None, true);
+            runs = {merged};
+            level++;
+        }
+    };
 
-    std::vector<std::vector<std::string>> sequences(NTHREADS);
+    /* The boundaries are found by all the threads before the first task starts */
+    std::vector<size_t> bounds = findChunkBounds(filename, chunk_size, NTHREADS);
 
     #pragma omp parallel
     {
         #pragma omp single
         {
-            size_t bytes_in_buffer = 0;
-
-            while (true) {
-                if (buffer_offset < bytes_in_buffer) {
-                    memmove(buffer.data(), buffer.data() + buffer_offset, bytes_in_buffer - buffer_offset);
-                    bytes_in_buffer -= buffer_offset;
-                } else {
-                    bytes_in_buffer = 0;
-                }
-                buffer_offset = 0;
-
-                ssize_t bytes_read = read(fd, buffer.data() + bytes_in_buffer, buffer.size() - bytes_in_buffer);
-                if (bytes_read < 0) {
-                    std::cerr << "Read error: " << strerror(errno) << std::endl;
-                    close(fd);
-                    exit(EXIT_FAILURE);
-                } else if (bytes_read == 0 && bytes_in_buffer == 0) {
-                    // EOF
-                    break;
-                }
-                bytes_in_buffer += bytes_read;
-
-                while (buffer_offset + sizeof(uint64_t) + sizeof(uint32_t) <= bytes_in_buffer) {
-                    size_t local_offset = buffer_offset;
-
-                    buffer_offset += sizeof(uint64_t);
-
-                    uint32_t len = *reinterpret_cast<uint32_t*>(&buffer[buffer_offset]);
-                    buffer_offset += sizeof(uint32_t);
-
-                    if (buffer_offset + len > bytes_in_buffer) {
-                        buffer_offset = local_offset;
-                        break;
-                    }
-
-                    buffer_offset += len;
-                    end_offset = file_offset + buffer_offset;
-
-                    if (end_offset - start_offset >= chunk_size) {
-                        size_t size = end_offset - start_offset;
-                        std::string uuid = generateUUID();
-                        #pragma omp task firstprivate(start_offset, size, uuid)
-                        {
-                            std::vector<std::string> seq = genSequenceFilesSTL(filename, start_offset, size, max_mem_per_worker, run_prefix + uuid);
-                            sequences[omp_get_thread_num()]
-                                .insert(
-                                    sequences[omp_get_thread_num()].end(),
-                                    std::make_move_iterator(seq.begin()),
-                                    std::make_move_iterator(seq.end())
-                                );
-                        }
-                        start_offset = end_offset;
-                    }
-                }
-
-                file_offset += buffer_offset;
-            }
-
-            if (end_offset > start_offset) {
-                size_t size = end_offset - start_offset;
-                std::string uuid = generateUUID();
-                #pragma omp task firstprivate(start_offset, size, uuid)
-                {
-                    std::vector<std::string> seq = genSequenceFilesSTL(filename, start_offset, size, max_mem_per_worker, run_prefix + uuid);
-                    sequences[omp_get_thread_num()]
-                        .insert(
-                            sequences[omp_get_thread_num()].end(),
-                            std::make_move_iterator(seq.begin()),
-                            std::make_move_iterator(seq.end())
-                        );
-                }
+            for (size_t i = 0; i + 1 < bounds.size(); i++) {
+                size_t start = bounds[i], size = bounds[i + 1] - bounds[i];
+                #pragma omp task firstprivate(start, size)
+                addRuns(genSequenceFilesSTL(filename, start, size, max_mem_per_worker, run_prefix + generateUUID()), 0);
             }
-
             #pragma omp taskwait
-            close(fd);
         }
     }
-    std::vector<std::string> all_sequences;
-    size_t total_size = 0;
-    for (const auto& v : sequences) total_size += v.size();
-    all_sequences.reserve(total_size);
 
-    for (auto& inner_vec : sequences) {
+    std::vector<std::string> all_sequences;
+    for (auto& level : levels)
         all_sequences.insert(all_sequences.end(),
-            std::make_move_iterator(inner_vec.begin()),
-            std::make_move_iterator(inner_vec.end()));
-    }
-    all_sequences.erase(
-        std::remove_if(all_sequences.begin(), all_sequences.end(),
-                       [](const std::string& f) { return f.empty(); }),
-        all_sequences.end()
-    );
-
+            std::make_move_iterator(level.begin()),
+            std::make_move_iterator(level.end()));
     return all_sequences;
 }
 
-static void ompMerge(const std::vector<std::string>& sequences, const std::string& merge_prefix, const std::string& output_file) {
+/**
+ * Merge the sorted runs into output_file following their optimal merge pattern
+ * (see merge_plan.hpp), with a fan-in fitting the memory and the descriptors of
+ * a thread. The merges below the final one are tasks, each waiting for the merges
+ * of its inputs, so independent subtrees are merged in parallel. The final merge
+ * is split among the threads by key range (see partitionedMergeFiles).
+ *
+ * @param durability When the output is flushed to storage, only the final merge uses it.
+ */
+static void ompMerge(const std::vector<std::string>& sequences, const std::string& merge_prefix, const std::string& output_file,
+                     Durability durability = Durability::None) {
     if (sequences.empty()) return;
     if (sequences.size() == 1) {
-        std::filesystem::rename(sequences[0], output_file);
+        moveRunToOutput(sequences[0], output_file, durability);
         return;
     }
 
-    /**
-     * Here I could've lowered the number of threads to allow the last pass (when the number of files is equal to the number of threads)
-     * in parallel, but where there are such few files, it doesn't make a significant difference, so it can be done sequentially, like the
-     * final merge below.
-     */
-    if (sequences.size() < 2 * NTHREADS) {
-        kWayMergeFiles(sequences, output_file, MAX_MEMORY);
-        return;
-    }
-
-    /* Ceil division */
-    const size_t group_size = (sequences.size() + NTHREADS - 1) / NTHREADS;
-    std::vector<std::string> intermediate_files(NTHREADS);
-
-    /**
-     * Here all threads from 0 to n-1 take exactly group_size sequences
-     * while the last thread takes the remaining sequences
-     */
-    #pragma omp parallel for
-    for (size_t i = 0; i < NTHREADS; i++) {
-        size_t start = i * group_size;
-        size_t end = std::min(start + group_size, sequences.size());
-        if (start >= end) continue;
+    std::vector<size_t> sizes;
+    for (const auto& s : sequences)
+        sizes.push_back(getFileSize(s));
+    const MergePlan plan = planMerges(sizes, mergeFanIn(MAX_MEMORY / NTHREADS, openFileBudget() / NTHREADS));
+
+    /* The file of every node of the tree, the outputs of the merges are named when they start */
+    std::vector<std::string> files(sequences);
+    files.resize(plan.runs + plan.steps.size());
+    auto inputsOf = [&](const MergeStep& step) {
+        std::vector<std::string> inputs;
+        for (size_t node : step.inputs)
+            inputs.push_back(files[node]);
+        return inputs;
+    };
+
+    std::function<void(size_t)> mergeStep = [&](size_t s) {
+        for (size_t node : plan.steps[s].inputs) {
+            if (plan.isRun(node)) continue;
+            #pragma omp task firstprivate(node)
+            mergeStep(node - plan.runs);
+        }
+        #pragma omp taskwait
+        std::string filename = runFileName(merge_prefix + generateUUID(), MERGE_TIER);
+        kWayMergeFiles(inputsOf(plan.steps[s]), filename, MAX_MEMORY / NTHREADS, Durability::None, true);
+        files[plan.runs + s] = filename;
+    };
 
-        std::vector<std::string> group(sequences.begin() + start, sequences.begin() + end);
-        std::string filename = merge_prefix + generateUUID();
-        kWayMergeFiles(group, filename, MAX_MEMORY / NTHREADS);
-        intermediate_files[i] = filename;
+    const MergeStep& last = plan.steps.back();
+    #pragma omp parallel
+    {
+        #pragma omp single
+        {
+            for (size_t node : last.inputs) {
+                if (plan.isRun(node)) continue;
+                #pragma omp task firstprivate(node)
+                mergeStep(node - plan.runs);
+            }
+        }
     }
 
-    /* Sometimes I got an empty string, so just remove it */
-    intermediate_files.erase(
-        std::remove_if(intermediate_files.begin(), intermediate_files.end(),
-                       [](const std::string& f) { return f.empty(); }),
-        intermediate_files.end()
-    );
-
-    /* Final merge of intermediate files */
-    std::string final_file = merge_prefix + generateUUID();
-    kWayMergeFiles(intermediate_files, output_file, MAX_MEMORY);
+    /* Final merge, with all the threads */
+    partitionedMergeFiles(inputsOf(last), output_file, MAX_MEMORY, NTHREADS, durability);
 }
 
 
@@ -0,0 +1,93 @@
+#ifndef _PARALLEL_SORT_HPP
+#define _PARALLEL_SORT_HPP
+
+#include "chunk.hpp"
+#include <algorithm>
+#include <cstddef>
+#include <omp.h>
+#include <vector>
+
+/* Below this many tags per thread, spawning the team is not worth it */
+static constexpr size_t PARALLEL_SORT_MIN_PER_THREAD = 1 << 15;
+/* Samples taken per bucket to choose the splitters */
+static constexpr size_t PARALLEL_SORT_OVERSAMPLING = 64;
+/* Buckets per thread, so that the dynamic schedule can balance skewed buckets */
+static constexpr size_t PARALLEL_SORT_BUCKETS_PER_THREAD = 4;
+
+/**
+ * Parallel sample sort of the tags of a chunk (or of any entries with a key member) using up to nthreads threads.
+ * The splitters are taken from a regular sample of the keys, every thread counts and
+ * then scatters its own block of tags into the buckets, and finally the buckets are
+ * sorted independently with the sequential kernel (std::sort or the radix engine).
+ *
+ * @param tags The tags to sort, replaced by the sorted ones.
+ * @param nthreads The thread budget.
+ * @param kernel The sequential sort, called as kernel(T* first, size_t n).
+ */
+template<typename T, typename Kernel>
+static void parallelSortTags(std::vector<T>& tags, unsigned int nthreads, Kernel kernel) {
+    const size_t n = tags.size();
+    nthreads = std::min<size_t>(nthreads, n / PARALLEL_SORT_MIN_PER_THREAD);
+    if (nthreads <= 1) {
+        kernel(tags.data(), n);
+        return;
+    }
+
+    const size_t nbuckets = nthreads * PARALLEL_SORT_BUCKETS_PER_THREAD;
+    const size_t nsamples = nbuckets * PARALLEL_SORT_OVERSAMPLING;
+    std::vector<unsigned long> samples(nsamples);
+    for (size_t i = 0; i < nsamples; i++)
+        samples[i] = tags[(i * n) / nsamples].key;
+    std::sort(samples.begin(), samples.end());
+
+    std::vector<unsigned long> splitters(nbuckets - 1);
+    for (size_t b = 1; b < nbuckets; b++)
+        splitters[b - 1] = samples[b * PARALLEL_SORT_OVERSAMPLING];
+
+    auto bucketOf = [&](unsigned long key) {
+        return static_cast<size_t>(std::upper_bound(splitters.begin(), splitters.end(), key) - splitters.begin());
+    };
+
+    /* counts[t * nbuckets + b] becomes the write position of thread t in bucket b */
+    std::vector<size_t> counts(nthreads * nbuckets, 0);
+    std::vector<size_t> bucket_start(nbuckets + 1, 0);
+    std::vector<T> sorted(n);
+
+    #pragma omp parallel num_threads(nthreads)
+    {
+        const size_t t = omp_get_thread_num();
+        const size_t begin = (t * n) / nthreads;
+        const size_t end = ((t + 1) * n) / nthreads;
+        size_t* my_counts = &counts[t * nbuckets];
+
+        for (size_t i = begin; i < end; i++)
+            my_counts[bucketOf(tags[i].key)]++;
+
+        #pragma omp barrier
+        #pragma omp single
+        {
+            size_t sum = 0;
+            for (size_t b = 0; b < nbuckets; b++) {
+                bucket_start[b] = sum;
+                for (size_t w = 0; w < nthreads; w++) {
+                    size_t c = counts[w * nbuckets + b];
+                    counts[w * nbuckets + b] = sum;
+                    sum += c;
+                }
+            }
+            bucket_start[nbuckets] = sum;
+        } // Implicit barrier
+
+        for (size_t i = begin; i < end; i++)
+            sorted[my_counts[bucketOf(tags[i].key)]++] = tags[i];
+
+        #pragma omp barrier
+        #pragma omp for schedule(dynamic, 1)
+        for (size_t b = 0; b < nbuckets; b++)
+            kernel(sorted.data() + bucket_start[b], bucket_start[b + 1] - bucket_start[b]);
+    }
+
+    tags.swap(sorted);
+}
+
+#endif // _PARALLEL_SORT_HPP
@@ -0,0 +1,273 @@
+#ifndef _PARTITIONED_MERGE_HPP
+#define _PARTITIONED_MERGE_HPP
+
+#include "common.hpp"
+#include "config.hpp"
+#include "merge_plan.hpp"
+#include "offset_index.hpp"
+#include "record_boundaries.hpp"
+#include "run_format.hpp"
+#include "sorting.hpp"
+#include <algorithm>
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <omp.h>
+#include <string>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+/* Below this many bytes the final merge is not worth splitting among the threads */
+static constexpr size_t PARTITIONED_MERGE_MIN_BYTES = 16UL << 20;
+/* Keys sampled from every input for each partition, to choose the splitters */
+static constexpr size_t PARTITION_SAMPLES = 32;
+
+/* Output of the merge of a partition: its slice of the shared mapping of the output file */
+struct SliceWriter {
+    char* data;
+    size_t pos = 0;
+
+    void append(const char* src, size_t bytes) {
+        std::memcpy(data + pos, src, bytes);
+        pos += bytes;
+    }
+};
+
+/* An input of a partitioned merge */
+struct PartitionedRun {
+    std::string name;
+    int fd;
+    size_t size;
+    std::vector<size_t> offsets; // Record starts, about RUN_INDEX_INTERVAL bytes apart
+    std::vector<size_t> cuts;    // Partition j is [cuts[j], cuts[j + 1])
+};
+
+static uint64_t readKeyAt(int fd, size_t offset) {
+    uint64_t key;
+    if (pread(fd, &key, sizeof(key), offset) != sizeof(key)) {
+        std::cerr << "Read error: " << strerror(errno) << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    return key;
+}
+
+/**
+ * Record starts of a run, computed with RECORD_STRIDE, taken from its offset index
+ * or else found by walking its headers (e.g. the runs received by the MPI master).
+ */
+static std::vector<size_t> runOffsets(const PartitionedRun& run) {
+    std::vector<size_t> offsets;
+    if (run.size == 0) return offsets;
+    if (RECORD_STRIDE) {
+        const size_t step = std::max<size_t>(RUN_INDEX_INTERVAL / RECORD_STRIDE, 1) * RECORD_STRIDE;
+        for (size_t p = 0; p < run.size; p += step)
+            offsets.push_back(p);
+        return offsets;
+    }
+    if (readOffsetIndex(run.name, run.size, offsets)) return offsets;
+
+    HeaderWalker walker(run.fd, run.size);
+    size_t p = 0, next_p;
+    offsets.push_back(0);
+    while (p < run.size && walker.next(p, next_p)) {
+        p = next_p;
+        if (p < run.size && p - offsets.back() >= RUN_INDEX_INTERVAL)
+            offsets.push_back(p);
+    }
+    return offsets;
+}
+
+/**
+ * Offset of the first record of a run with a key greater than bound, or its size.
+ * The last entry of the offsets with a key up to bound is binary searched, then
+ * the headers are walked from there, less than an interval.
+ */
+static size_t upperBoundOffset(const PartitionedRun& run, HeaderWalker& walker, uint64_t bound) {
+    size_t lo = 0, hi = run.offsets.size();
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (readKeyAt(run.fd, run.offsets[mid]) <= bound) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo == 0) return 0;
+
+    size_t p = run.offsets[lo - 1], next_p;
+    while (p < run.size) {
+        uint64_t key;
+        std::memcpy(&key, walker.header(p), sizeof(key));
+        if (key > bound || !walker.next(p, next_p)) break;
+        p = next_p;
+    }
+    return p;
+}
+
+/**
+ * Keys splitting the records of the runs into parts ranges of about the same bytes,
+ * range j holding the keys in (splitters[j - 1], splitters[j]]. Every run is sampled
+ * at PARTITION_SAMPLES * parts of its offsets, each sample standing for the bytes
+ * up to the next one.
+ */
+static std::vector<uint64_t> chooseSplitters(const std::vector<PartitionedRun>& runs, size_t parts) {
+    std::vector<std::vector<std::pair<uint64_t, size_t>>> run_samples(runs.size());
+    #pragma omp parallel for schedule(dynamic, 1) num_threads(parts)
+    for (size_t r = 0; r < runs.size(); r++) {
+        const PartitionedRun& run = runs[r];
+        const size_t n = std::min(run.offsets.size(), PARTITION_SAMPLES * parts);
+        for (size_t i = 0; i < n; i++) {
+            const size_t e = (i * run.offsets.size()) / n;
+            const size_t next = (i + 1 < n) ? run.offsets[((i + 1) * run.offsets.size()) / n] : run.size;
+            run_samples[r].emplace_back(readKeyAt(run.fd, run.offsets[e]), next - run.offsets[e]);
+        }
+    }
+
+    std::vector<std::pair<uint64_t, size_t>> samples;
+    size_t total = 0;
+    for (const auto& s : run_samples) {
+        samples.insert(samples.end(), s.begin(), s.end());
+        for (const auto& sample : s)
+            total += sample.second;
+    }
+    std::sort(samples.begin(), samples.end());
+
+    std::vector<uint64_t> splitters;
+    size_t seen = 0;
+    for (const auto& sample : samples) {
+        seen += sample.second;
+        while (splitters.size() + 1 < parts && seen >= (total / parts) * (splitters.size() + 1))
+            splitters.push_back(sample.first);
+    }
+    while (splitters.size() + 1 < parts)
+        splitters.push_back(ULONG_MAX);
+    return splitters;
+}
+
+/**
+ * Merge sorted runs into the output with nthreads threads, each merging a disjoint
+ * key range of all the runs. The splitters of the ranges are chosen from keys sampled
+ * from every run, then each run is cut at them by a binary search over its offset
+ * index. The bytes of the ranges before a range give its offset in the output, so
+ * each thread writes its slice of a shared mapping of the output file, presized to
+ * the total, with no coordination.
+ * More runs than the windows of a range or the descriptors allow are merged down
+ * first, the smallest ones (see mergeDownTo).
+ * The runs must be plain: with other formats, -D or -u, on few bytes or a single
+ * thread, the runs go to a single kWayMergeFiles instead.
+ *
+ * @param input_files The runs, deleted when merged.
+ * @param output_filename The output file.
+ * @param max_mem The memory for the windows of the inputs, split among the threads.
+ * @param nthreads The number of threads, and of key ranges.
+ * @param durability When the output is flushed to storage: once at the end, or every
+ *                   slice when it is written with PerBatch.
+ */
+static void partitionedMergeFiles(const std::vector<std::string>& input_files,
+                                  const std::string& output_filename,
+                                  size_t max_mem,
+                                  unsigned int nthreads,
+                                  Durability durability) {
+    /* Every range has a window on every run, too many runs are merged down first */
+    const std::vector<std::string> runs_left =
+        mergeDownTo(input_files, mergeFanIn(max_mem / std::max(1u, nthreads), openFileBudget()), max_mem, output_filename);
+    size_t total_bytes = 0;
+    bool plain = true;
+    for (const auto& f : runs_left) {
+        total_bytes += getFileSize(f);
+        plain = plain && runFormat(f) == RunFormat::Plain;
+    }
+    if (!plain || DIRECT_IO || IO_URING || nthreads < 2 || total_bytes < PARTITIONED_MERGE_MIN_BYTES) {
+        kWayMergeFiles(runs_left, output_filename, max_mem, durability);
+        return;
+    }
+
+    const size_t parts = nthreads;
+    std::vector<PartitionedRun> runs(runs_left.size());
+    for (size_t r = 0; r < runs.size(); r++) {
+        runs[r].name = runs_left[r];
+        runs[r].fd = openFile(runs_left[r]);
+        runs[r].size = getFileSize(runs_left[r]);
+    }
+    #pragma omp parallel for schedule(dynamic, 1) num_threads(nthreads)
+    for (size_t r = 0; r < runs.size(); r++)
+        runs[r].offsets = runOffsets(runs[r]);
+
+    const std::vector<uint64_t> splitters = chooseSplitters(runs, parts);
+    #pragma omp parallel for schedule(dynamic, 1) num_threads(nthreads)
+    for (size_t r = 0; r < runs.size(); r++) {
+        PartitionedRun& run = runs[r];
+        HeaderWalker walker(run.fd, run.size, RUN_INDEX_INTERVAL);
+        run.cuts.push_back(0);
+        for (uint64_t splitter : splitters)
+            run.cuts.push_back(splitter == ULONG_MAX ? run.size : upperBoundOffset(run, walker, splitter));
+        run.cuts.push_back(run.size);
+    }
+
+    int out_fd = open(output_filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (out_fd < 0) {
+        std::cerr << "Error opening output file: " << output_filename << " " << strerror(errno) << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    if (ftruncate(out_fd, total_bytes) != 0) {
+        std::cerr << "ftruncate failed: " << strerror(errno) << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    /* Reserve the blocks upfront, it is fine if the file system can't */
+    fallocate(out_fd, FALLOC_FL_KEEP_SIZE, 0, total_bytes);
+    void* map_ptr = mmap(nullptr, total_bytes, PROT_WRITE, MAP_SHARED, out_fd, 0);
+    if (map_ptr == MAP_FAILED) {
+        std::cerr << "mmap failed: " << strerror(errno) << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    char* out = static_cast<char*>(map_ptr);
+
+    const size_t usable_mem = std::max<size_t>(max_mem / parts / runs.size(), 4096UL);
+    const size_t page_size = sysconf(_SC_PAGESIZE);
+    #pragma omp parallel for schedule(dynamic, 1) num_threads(nthreads)
+    for (size_t j = 0; j < parts; j++) {
+        /* The slice of range j starts after the bytes of the lower ranges of every run */
+        size_t slice_offset = 0, slice_bytes = 0;
+        std::vector<BufferState> buffers;
+        buffers.reserve(runs.size());
+        for (size_t r = 0; r < runs.size(); r++) {
+            const size_t begin = runs[r].cuts[j], end = runs[r].cuts[j + 1];
+            slice_offset += begin;
+            slice_bytes += end - begin;
+            /* The inputs share the descriptors of the runs, they are closed at the end */
+            if (end > begin)
+                buffers.emplace_back(runs[r].fd, runs[r].name, r, usable_mem, begin, end - begin);
+        }
+        if (buffers.empty()) continue;
+
+        SliceWriter slice{out + slice_offset};
+        if (buffers.size() <= LANE_MERGE_MAX_FANIN)
+            laneMergeBuffers(buffers, slice);
+        else
+            loserTreeMergeBuffers(buffers, slice);
+        if (slice.pos != slice_bytes) {
+            std::cerr << "Merged " << slice.pos << " bytes instead of " << slice_bytes
+                      << " for a key range of " << output_filename << std::endl;
+            exit(EXIT_FAILURE);
+        }
+
+        if (durability == Durability::PerBatch) {
+            const size_t start = slice_offset & ~(page_size - 1);
+            if (msync(out + start, slice_offset + slice_bytes - start, MS_SYNC) != 0)
+                std::cerr << "msync failed: " << strerror(errno) << std::endl;
+        }
+    }
+
+    if (durability == Durability::AtClose && msync(map_ptr, total_bytes, MS_SYNC) != 0)
+        std::cerr << "msync failed: " << strerror(errno) << std::endl;
+    munmap(map_ptr, total_bytes);
+    close(out_fd);
+    for (const PartitionedRun& run : runs) {
+        close(run.fd);
+        deleteRun(run.name);
+    }
+}
+
+#endif // _PARTITIONED_MERGE_HPP
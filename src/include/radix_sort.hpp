@@ -0,0 +1,166 @@
+#ifndef _RADIX_SORT_HPP
+#define _RADIX_SORT_HPP
+
+#include "chunk.hpp"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+/* Below this size a comparison sort beats any radix pass */
+static constexpr size_t RADIX_SMALL_SORT = 64;
+/* Below this size the MSD variant is used, so that the scratch buffer is not needed */
+static constexpr size_t RADIX_LSD_THRESHOLD = 1 << 16;
+/* If max - min is below this, a single counting pass on (key - min) sorts the whole chunk */
+static constexpr unsigned long RADIX_COUNTING_RANGE = 1 << 16;
+
+static inline unsigned int radixDigit(unsigned long key, unsigned int byte) {
+    return (key >> (8 * byte)) & 0xFF;
+}
+
+/* Index of the most significant byte set in mask below or at byte, -1 if there is none */
+static inline int radixNextByte(unsigned long mask, int byte) {
+    while (byte >= 0 && radixDigit(mask, byte) == 0) byte--;
+    return byte;
+}
+
+/**
+ * In-place MSD radix sort (american flag sort) on the byte `byte` of the keys.
+ * Bytes that never change across the chunk (zero in diff) are skipped, and buckets
+ * smaller than RADIX_SMALL_SORT fall back to std::sort.
+ */
+template<typename T>
+static void msdRadixSort(T* tags, size_t n, int byte, unsigned long diff) {
+    byte = radixNextByte(diff, byte);
+    if (n <= RADIX_SMALL_SORT || byte < 0) {
+        if (byte >= 0) std::sort(tags, tags + n);
+        return;
+    }
+
+    size_t count[256] = {0};
+    for (size_t i = 0; i < n; i++)
+        count[radixDigit(tags[i].key, byte)]++;
+
+    size_t head[256], tail[256];
+    size_t sum = 0;
+    for (unsigned int d = 0; d < 256; d++) {
+        head[d] = sum;
+        sum += count[d];
+        tail[d] = sum;
+    }
+
+    /* Cycle each tag to its bucket, every swap places at least one tag for good */
+    for (unsigned int d = 0; d < 256; d++) {
+        while (head[d] < tail[d]) {
+            T tag = tags[head[d]];
+            unsigned int digit = radixDigit(tag.key, byte);
+            while (digit != d) {
+                std::swap(tag, tags[head[digit]++]);
+                digit = radixDigit(tag.key, byte);
+            }
+            tags[head[d]++] = tag;
+        }
+    }
+
+    size_t start = 0;
+    for (unsigned int d = 0; d < 256; d++) {
+        if (count[d] > 1)
+            msdRadixSort(tags + start, count[d], byte - 1, diff);
+        start += count[d];
+    }
+}
+
+/**
+ * LSD radix sort with one scatter pass per byte that actually changes across the chunk,
+ * all the histograms are computed with a single read of the tags.
+ * With the 32-bit keys generated by gen_file the 4 high bytes are always skipped.
+ */
+template<typename T>
+static void lsdRadixSort(T* tags, size_t n, unsigned long diff) {
+    unsigned int bytes[sizeof(unsigned long)];
+    unsigned int nbytes = 0;
+    for (unsigned int b = 0; b < sizeof(unsigned long); b++)
+        if (radixDigit(diff, b)) bytes[nbytes++] = b;
+
+    std::vector<size_t> hist(nbytes * 256, 0);
+    for (size_t i = 0; i < n; i++)
+        for (unsigned int j = 0; j < nbytes; j++)
+            hist[j * 256 + radixDigit(tags[i].key, bytes[j])]++;
+
+    std::unique_ptr<T[]> scratch(new T[n]);
+    T* src = tags;
+    T* dst = scratch.get();
+    for (unsigned int j = 0; j < nbytes; j++) {
+        size_t* offsets = &hist[j * 256];
+        size_t sum = 0;
+        for (unsigned int d = 0; d < 256; d++) {
+            size_t c = offsets[d];
+            offsets[d] = sum;
+            sum += c;
+        }
+        for (size_t i = 0; i < n; i++)
+            dst[offsets[radixDigit(src[i].key, bytes[j])]++] = src[i];
+        std::swap(src, dst);
+    }
+
+    if (src != tags)
+        std::copy(src, src + n, tags);
+}
+
+/* Single counting pass on key - min, used when the key range is tiny */
+template<typename T>
+static void countingSort(T* tags, size_t n, unsigned long min, unsigned long range) {
+    std::vector<size_t> offsets(range + 1, 0);
+    for (size_t i = 0; i < n; i++)
+        offsets[tags[i].key - min]++;
+
+    size_t sum = 0;
+    for (auto& o : offsets) {
+        size_t c = o;
+        o = sum;
+        sum += c;
+    }
+
+    std::unique_ptr<T[]> scratch(new T[n]);
+    for (size_t i = 0; i < n; i++)
+        scratch[offsets[tags[i].key - min]++] = tags[i];
+    std::copy(scratch.get(), scratch.get() + n, tags);
+}
+
+/**
+ * Sort (key, offset) tags, or any other entries with a key member, by key.
+ * The variant is chosen from the chunk:
+ * tiny chunks use std::sort, tiny key ranges a counting sort, small chunks the
+ * in-place MSD radix sort and large chunks the LSD one.
+ */
+template<typename T>
+static void radixSortTags(T* tags, size_t n) {
+    if (n <= RADIX_SMALL_SORT) {
+        std::sort(tags, tags + n);
+        return;
+    }
+
+    unsigned long min = tags[0].key, max = tags[0].key, diff = 0;
+    for (size_t i = 1; i < n; i++) {
+        min = std::min(min, tags[i].key);
+        max = std::max(max, tags[i].key);
+        diff |= tags[i].key ^ tags[0].key;
+    }
+
+    if (diff == 0) return; // All the keys are the same
+
+    if (max - min < RADIX_COUNTING_RANGE && max - min < n)
+        countingSort(tags, n, min, max - min);
+    else if (n < RADIX_LSD_THRESHOLD)
+        msdRadixSort(tags, n, sizeof(unsigned long) - 1, diff);
+    else
+        lsdRadixSort(tags, n, diff);
+}
+
+template<typename T>
+static inline void radixSortTags(std::vector<T>& tags) {
+    radixSortTags(tags.data(), tags.size());
+}
+
+#endif // _RADIX_SORT_HPP
@@ -100,7 +100,7 @@ typedef struct _Record {
  */
 
 struct HeapRecordComparator {
-    bool operator()(Record a, Record b){
+    bool operator()(const Record& a, const Record& b) const {
         return (a.key > b.key);
     }
 };
@@ -112,7 +112,7 @@ struct HeapPairRecordComparator {
 };
 
 struct RecordComparator {
-    bool operator()(Record a, Record b){
+    bool operator()(const Record& a, const Record& b) const {
         return (a.key < b.key);
     }
 };
@@ -0,0 +1,285 @@
+#ifndef _RECORD_BOUNDARIES_HPP
+#define _RECORD_BOUNDARIES_HPP
+
+#include "chunk.hpp"
+#include "common.hpp"
+#include "config.hpp"
+#include "offset_index.hpp"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <omp.h>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+/* Records whose lengths must chain up from an offset for a scan to start there */
+static constexpr size_t BOUNDARY_CHAIN_RECORDS = 16;
+/* Boundaries remembered from the start of a scan, where the chain of the previous range can meet it */
+static constexpr size_t BOUNDARY_SYNC_POINTS = 1024;
+/* Records walked from the start of the file to guess the largest plausible length */
+static constexpr size_t BOUNDARY_SAMPLE_RECORDS = 4096;
+/* Bytes of the file viewed at a time while walking the headers */
+static constexpr size_t BOUNDARY_VIEW_BYTES = 1UL << 20;
+/* Smallest range scanned by a thread, smaller files are walked by a single one */
+static constexpr size_t BOUNDARY_MIN_RANGE = 4UL << 20;
+
+/**
+ * Walk over the headers of a chain of records in a file. The file is read with pread,
+ * BOUNDARY_VIEW_BYTES at a time, into a buffer of the walker: a mapping would cost
+ * a page fault for every page walked, which does not scale with the threads.
+ */
+struct HeaderWalker {
+    int fd;
+    size_t file_size;
+    std::vector<char> span;
+    size_t span_offset = 0;
+    size_t span_len = 0;
+
+    HeaderWalker(int fd, size_t file_size, size_t span_bytes = BOUNDARY_VIEW_BYTES)
+        : fd(fd), file_size(file_size), span(span_bytes) {}
+
+    /* The header of the record at p, which must be inside the file */
+    const char* header(size_t p) {
+        if (p < span_offset || p + RECORD_HEADER_SIZE > span_offset + span_len) {
+            ssize_t bytes_read = pread(fd, span.data(), std::min(span.size(), file_size - p), p);
+            if (bytes_read < static_cast<ssize_t>(RECORD_HEADER_SIZE)) {
+                std::cerr << "Read error: " << strerror(errno) << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            span_offset = p;
+            span_len = bytes_read;
+        }
+        return span.data() + (p - span_offset);
+    }
+
+    /**
+     * Offset of the record after the one at p.
+     *
+     * @return Whether the record at p is entirely inside the file.
+     */
+    bool next(size_t p, size_t& next_p) {
+        if (p + RECORD_HEADER_SIZE > file_size) return false;
+        uint32_t len;
+        std::memcpy(&len, header(p) + sizeof(uint64_t), sizeof(len));
+        next_p = p + RECORD_HEADER_SIZE + len;
+        return next_p <= file_size;
+    }
+};
+
+/**
+ * Whether the boundary next_p, right after the boundary p, starts a chunk: it does if it is
+ * the first one at or past a multiple of chunk_size. It only depends on the record before
+ * it, so two walks along the same chain cut it at the same places wherever they started.
+ */
+static inline bool startsChunk(size_t p, size_t next_p, size_t chunk_size) {
+    return next_p / chunk_size > p / chunk_size;
+}
+
+/* Chain of records followed by one thread over a range of the file */
+struct BoundaryScan {
+    size_t from = 0;           // Where the chain starts
+    std::vector<size_t> sync;  // The first boundaries of the chain after from, in order
+    std::vector<size_t> cuts;  // Boundaries of the chain after from that start a chunk
+    size_t end = 0;            // First boundary of the chain past the range, or where it broke
+    bool broken = false;       // The chain ran off the file
+
+    /* Follow the chain from the record at start until it leaves [start, range_end) */
+    void walk(HeaderWalker& walker, size_t start, size_t range_end, size_t chunk_size) {
+        size_t p = start;
+        from = start;
+        while (p < range_end) {
+            size_t next_p;
+            if (!walker.next(p, next_p)) {
+                broken = true;
+                break;
+            }
+            if (sync.size() < BOUNDARY_SYNC_POINTS) sync.push_back(next_p);
+            if (startsChunk(p, next_p, chunk_size)) cuts.push_back(next_p);
+            p = next_p;
+        }
+        end = p;
+    }
+};
+
+/**
+ * Whether BOUNDARY_CHAIN_RECORDS records, all with a length up to max_len, follow one
+ * another from p (or reach exactly the end of the file): p is likely a record start.
+ */
+static bool plausibleChain(HeaderWalker& walker, size_t p, size_t max_len) {
+    for (size_t n = 0; n < BOUNDARY_CHAIN_RECORDS && p < walker.file_size; n++) {
+        size_t next_p;
+        if (!walker.next(p, next_p) || next_p - p - RECORD_HEADER_SIZE > max_len) return false;
+        p = next_p;
+    }
+    return true;
+}
+
+/**
+ * The chunks of findChunkBounds found with an offset index: the first record at or past each
+ * multiple of chunk_size is reached by walking the headers from the last entry before it,
+ * less than the gap between two entries, for all the multiples in parallel.
+ */
+static std::vector<size_t> chunkBoundsFromIndex(int fd, const std::vector<size_t>& index, size_t file_size,
+                                                size_t chunk_size, unsigned int nthreads) {
+    const size_t multiples = (file_size - 1) / chunk_size;
+    std::vector<size_t> cuts(multiples, file_size);
+    #pragma omp parallel for schedule(dynamic, 1) num_threads(std::max(1u, nthreads))
+    for (size_t k = 0; k < multiples; k++) {
+        const size_t multiple = (k + 1) * chunk_size;
+        HeaderWalker walker(fd, file_size);
+        size_t p = *(std::upper_bound(index.begin(), index.end(), multiple) - 1), next_p;
+        while (p < multiple && walker.next(p, next_p))
+            p = next_p;
+        if (p >= multiple) cuts[k] = p;
+    }
+
+    /* A record longer than chunk_size is the cut of more than one multiple */
+    std::vector<size_t> bounds = {0};
+    for (size_t cut : cuts)
+        if (cut > bounds.back() && cut < file_size)
+            bounds.push_back(cut);
+    bounds.push_back(file_size);
+    return bounds;
+}
+
+/**
+ * Split a file of serialized records into chunks of whole records of about chunk_size bytes:
+ * chunk i starts at the first record boundary at or past i * chunk_size (see startsChunk),
+ * so a chunk is within the longest record of chunk_size bytes, but the last one, which may
+ * be shorter. The chunks are the ones a single scan over the headers would cut.
+ * The file is cut into ranges scanned in parallel by nthreads threads. Each thread
+ * guesses the first record start of its range, the first offset from which a chain of
+ * plausible records follows, and walks the chain from there. The guesses are then
+ * validated in order: the true chain coming from the previous range is walked until it
+ * meets one of the first boundaries of the scan, from there on the two are the same.
+ * Only a range whose guess is not met is walked again, from the true boundary.
+ *
+ * With RECORD_STRIDE set the boundaries are computed instead. With an offset index
+ * (see offset_index.hpp) whose entries are closer than chunk_size, the headers are only
+ * walked from the entry before each cut (see chunkBoundsFromIndex); otherwise the ranges
+ * start at entries of the index, so that no guess is needed.
+ *
+ * @return The offsets of the chunks, chunk i being [bounds[i], bounds[i + 1]). A partial
+ *         record at the end of the file is left out, like the scans did.
+ */
+static std::vector<size_t> findChunkBounds(const std::string& filename, size_t chunk_size, unsigned int nthreads) {
+    const size_t file_size = getFileSize(filename);
+    std::vector<size_t> bounds;
+    if (file_size == 0) return bounds;
+    chunk_size = std::max<size_t>(chunk_size, 1);
+    if (RECORD_STRIDE) {
+        size_t start = 0;
+        while (start < file_size) {
+            bounds.push_back(start);
+            /* The first record at or past the next multiple of chunk_size */
+            const size_t next = (start / chunk_size + 1) * chunk_size;
+            start = ((next + RECORD_STRIDE - 1) / RECORD_STRIDE) * RECORD_STRIDE;
+        }
+        bounds.push_back(file_size);
+        return bounds;
+    }
+
+    std::vector<size_t> index;
+    const bool indexed = readOffsetIndex(filename, file_size, index);
+    size_t max_gap = 0;
+    if (indexed) {
+        max_gap = file_size - index.back();
+        for (size_t i = 1; i < index.size(); i++)
+            max_gap = std::max(max_gap, index[i] - index[i - 1]);
+    }
+
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        std::cerr << "Error opening file: " << filename << " " << strerror(errno) << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    if (indexed && max_gap <= chunk_size) {
+        bounds = chunkBoundsFromIndex(fd, index, file_size, chunk_size, nthreads);
+        close(fd);
+        return bounds;
+    }
+
+    size_t nranges = std::max<size_t>(1, std::min<size_t>(4 * nthreads, file_size / BOUNDARY_MIN_RANGE));
+    if (indexed) nranges = std::min(nranges, index.size());
+    auto rangeStart = [&](size_t r) {
+        if (r == nranges) return file_size;
+        return indexed ? index[(r * index.size()) / nranges] : (r * file_size) / nranges;
+    };
+    /* The lengths of the first records bound the ones a guess may have */
+    size_t max_len = 0;
+    {
+        HeaderWalker walker(fd, file_size);
+        size_t p = 0, next_p;
+        for (size_t n = 0; n < BOUNDARY_SAMPLE_RECORDS && walker.next(p, next_p); n++) {
+            max_len = std::max(max_len, next_p - p - RECORD_HEADER_SIZE);
+            p = next_p;
+        }
+        max_len = 4 * max_len + 64;
+    }
+
+    std::vector<BoundaryScan> scans(nranges);
+    #pragma omp parallel for schedule(dynamic, 1) num_threads(std::max(1u, nthreads))
+    for (size_t r = 0; r < nranges; r++) {
+        const size_t begin = rangeStart(r), end = rangeStart(r + 1);
+        HeaderWalker walker(fd, file_size);
+        size_t guess = begin;
+        if (r > 0 && !indexed) {
+            const size_t last_guess = std::min(end, begin + BOUNDARY_VIEW_BYTES);
+            while (guess < last_guess && !plausibleChain(walker, guess, max_len))
+                guess++;
+        }
+        if (guess < end)
+            scans[r].walk(walker, guess, end, chunk_size);
+        else
+            scans[r].broken = true;
+    }
+
+    /* Follow the true chain across the ranges, the first one starts at the start of the file */
+    bounds.push_back(0);
+    size_t start = 0;
+    for (size_t r = 0; r < nranges; r++) {
+        const size_t end = rangeStart(r + 1);
+        if (start >= end) continue; // A record spans the whole range
+        BoundaryScan& scan = scans[r];
+
+        /* The true chain cuts its own chunks until it meets the scan */
+        HeaderWalker walker(fd, file_size);
+        size_t p = start, next_p;
+        bool met = false;
+        while (!scan.broken && !scan.sync.empty() && p <= scan.sync.back() && p < end) {
+            if (p == scan.from || std::binary_search(scan.sync.begin(), scan.sync.end(), p)) {
+                met = true;
+                break;
+            }
+            if (!walker.next(p, next_p)) break;
+            if (startsChunk(p, next_p, chunk_size)) bounds.push_back(next_p);
+            p = next_p;
+        }
+
+        if (met) {
+            /* The scan is right from p on */
+            for (size_t cut : scan.cuts)
+                if (cut > p) bounds.push_back(cut);
+            start = scan.end;
+        } else {
+            BoundaryScan rescan;
+            rescan.walk(walker, p, end, chunk_size);
+            bounds.insert(bounds.end(), rescan.cuts.begin(), rescan.cuts.end());
+            start = rescan.end;
+            if (rescan.broken) break;
+        }
+    }
+    /* Drop an empty chunk left at the end, then close the last one */
+    if (bounds.back() == start)
+        bounds.pop_back();
+    if (!bounds.empty())
+        bounds.push_back(start);
+    close(fd);
+    return bounds;
+}
+
+#endif // _RECORD_BOUNDARIES_HPP
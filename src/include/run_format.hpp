@@ -0,0 +1,33 @@
+#ifndef _RUN_FORMAT_HPP
+#define _RUN_FORMAT_HPP
+
+#include "block_codec.hpp"
+#include "columnar_run.hpp"
+#include "common.hpp"
+#include "config.hpp"
+#include <string>
+
+/**
+ * Formats of the files written by a RunWriter: the plain stream of serialized records,
+ * the block-compressed one (block_codec.hpp) and the columnar one (columnar_run.hpp).
+ * The final output is always plain, the format of a temporary file is told by its name.
+ */
+enum class RunFormat { Plain, Compressed, Columnar };
+
+static RunFormat runFormat(const std::string& name) {
+    if (isCompressedRun(name)) return RunFormat::Compressed;
+    if (isColumnarRun(name)) return RunFormat::Columnar;
+    return RunFormat::Plain;
+}
+
+/**
+ * Path of a temporary file of the given tier: in one of the scratch directories,
+ * if any, and with the suffix of the format chosen for the tier.
+ */
+static std::string runFileName(const std::string& name, unsigned int tier) {
+    const std::string path = scratchPath(name);
+    if (COLUMNAR_RUNS) return path + COLUMNAR_RUN_SUFFIX;
+    return (COMPRESSED_TIERS & tier) ? path + COMPRESSED_RUN_SUFFIX : path;
+}
+
+#endif // _RUN_FORMAT_HPP
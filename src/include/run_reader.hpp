@@ -0,0 +1,184 @@
+#ifndef _RUN_READER_HPP
+#define _RUN_READER_HPP
+
+#include "chunk.hpp"
+#include "common.hpp"
+#include "config.hpp"
+#include "record.hpp"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <iostream>
+#include <memory>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <type_traits>
+#include <unistd.h>
+#include <vector>
+
+/* Granularity of the read ahead and of the release of the bytes already read */
+static constexpr size_t RUN_READER_STEP = 4UL << 20;
+
+/**
+ * Sequential reader of the records of a region of a file, it replaces the fstat,
+ * mmap and munmap that every readRecordsFromFile call used to do.
+ * The region is mapped once, the first time it is needed, with sequential hints,
+ * and then walked in order: the kernel is asked to read RUN_READER_STEP bytes ahead
+ * of the last byte requested, and the pages behind the current position are dropped
+ * from the mapping a step at a time, so only a sliding window stays resident.
+ * The bytes handed out by a read (or a view) are valid until the next one.
+ */
+struct RunReader {
+    int fd;
+    size_t begin = 0;      // File offset of the region
+    size_t length = 0;     // Bytes of the region
+    size_t pos = 0;        // Bytes of the region already read
+    void* mapping = nullptr;
+    size_t map_len = 0;
+    size_t map_delta = 0;  // Bytes between the start of the mapping and begin
+    size_t released = 0;   // Bytes at the start of the mapping dropped from memory
+    size_t advised = 0;    // Bytes of the region the kernel was asked to read ahead
+
+    /**
+     * @param fd The file to read, it must be already open.
+     * @param offset The offset of the region in the file.
+     * @param bytes The bytes of the region, it is clipped to the end of the file.
+     */
+    RunReader(int fd, size_t offset = 0, size_t bytes = SIZE_MAX) : fd(fd) {
+        struct stat st;
+        if (fstat(fd, &st) < 0) {
+            std::cerr << "fstat failed: " << strerror(errno) << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        size_t file_size = static_cast<size_t>(st.st_size);
+        begin = std::min(offset, file_size);
+        length = std::min(bytes, file_size - begin);
+    }
+
+    RunReader(RunReader&& other) noexcept
+        : fd(other.fd), begin(other.begin), length(other.length), pos(other.pos), mapping(other.mapping),
+          map_len(other.map_len), map_delta(other.map_delta), released(other.released), advised(other.advised) {
+        other.mapping = nullptr;
+    }
+
+    RunReader(const RunReader&) = delete;
+    RunReader& operator=(const RunReader&) = delete;
+
+    ~RunReader() {
+        if (mapping) munmap(mapping, map_len);
+    }
+
+    size_t offset() const { return begin + pos; }
+    size_t remaining() const { return length - pos; }
+
+    /* Bytes of the record at the current position, read from its header, 0 if not even that is left */
+    size_t nextRecordBytes() {
+        if (RECORD_STRIDE) return RECORD_STRIDE;
+        if (remaining() < RECORD_HEADER_SIZE) return 0;
+        return VariableLayout::recordSize(view(offset(), RECORD_HEADER_SIZE));
+    }
+
+    /**
+     * Pointer to the bytes [offset, offset + len) of the file, inside the region.
+     * The bytes before offset are taken as consumed and may be dropped.
+     */
+    const char* view(size_t offset, size_t len) {
+        if (!mapping) map();
+        const size_t rel = offset - begin;
+
+        /* Drop the whole pages already consumed, one step at a time */
+        const size_t page_size = sysconf(_SC_PAGESIZE);
+        const size_t consumed = (map_delta + rel) & ~(page_size - 1);
+        if (consumed >= released + RUN_READER_STEP) {
+            madvise(static_cast<char*>(mapping) + released, consumed - released, MADV_DONTNEED);
+            released = consumed;
+        }
+
+        /* Keep the kernel a step ahead of the last byte requested */
+        if (rel + len > advised) {
+            size_t end = std::min(length, rel + len + RUN_READER_STEP);
+            posix_fadvise(fd, begin + advised, end - advised, POSIX_FADV_WILLNEED);
+            advised = end;
+        }
+        return static_cast<const char*>(mapping) + map_delta + rel;
+    }
+
+    /**
+     * Read whole records from the current position into a container that can be a vector,
+     * a deque, a priority queue or a chunk, covering at most max_bytes of the region.
+     * A RecordChunk gets the records with a single copy into its slab, while a MappedChunk
+     * only indexes them in place. When RECORD_STRIDE is set the record boundaries are
+     * computed instead of scanned.
+     *
+     * @return The number of bytes read.
+     */
+    template<typename Container>
+    size_t read(Container& records, size_t max_bytes) {
+        const size_t limit = std::min(max_bytes, remaining());
+        if (limit == 0) return 0;
+        const char* data = view(offset(), limit);
+        size_t parsed = 0;
+
+        if constexpr (std::is_same_v<Container, MappedChunk>) {
+            if (RECORD_STRIDE)
+                parsed = records.view(data, limit, FixedLayout{RECORD_STRIDE});
+            else
+                parsed = records.view(data, limit);
+        } else if constexpr (std::is_same_v<Container, RecordChunk>) {
+            if (RECORD_STRIDE)
+                parsed = records.appendRecords(data, limit, limit, FixedLayout{RECORD_STRIDE});
+            else
+                parsed = records.appendRecords(data, limit, limit);
+        } else if constexpr (is_fixed_chunk<Container>::value) {
+            parsed = records.appendRecords(data, limit, limit);
+        } else {
+            while (parsed + RECORD_HEADER_SIZE <= limit) {
+                uint64_t key;
+                uint32_t len;
+                std::memcpy(&key, data + parsed, sizeof(key));
+                std::memcpy(&len, data + parsed + sizeof(key), sizeof(len));
+
+                size_t record_size = RECORD_HEADER_SIZE + static_cast<size_t>(len);
+                if (parsed + record_size > limit) break;
+
+                Record rec;
+                rec.key = key;
+                rec.len = len;
+                rec.rpayload = std::make_unique<char[]>(len);
+                std::memcpy(rec.rpayload.get(), data + parsed + RECORD_HEADER_SIZE, len);
+
+                if constexpr (
+                    std::is_same_v<Container, std::vector<Record>> ||
+                    std::is_same_v<Container, std::deque<Record>>) {
+                    records.push_back(std::move(rec));
+                } else {
+                    records.push(std::move(rec));
+                }
+                parsed += record_size;
+            }
+        }
+
+        pos += parsed;
+        return parsed;
+    }
+
+    /* Map the whole region and tell the kernel it is going to be read sequentially */
+    void map() {
+        const size_t page_size = sysconf(_SC_PAGESIZE);
+        const size_t map_offset = begin & ~(page_size - 1);
+        map_delta = begin - map_offset;
+        map_len = std::max<size_t>(map_delta + length, 1);
+        mapping = mmap(nullptr, map_len, PROT_READ, MAP_PRIVATE, fd, map_offset);
+        if (mapping == MAP_FAILED) {
+            std::cerr << "mmap failed: " << strerror(errno) << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        madvise(mapping, map_len, MADV_SEQUENTIAL);
+        posix_fadvise(fd, begin, length, POSIX_FADV_SEQUENTIAL);
+    }
+};
+
+#endif // _RUN_READER_HPP
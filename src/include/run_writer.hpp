@@ -0,0 +1,344 @@
+#ifndef _RUN_WRITER_HPP
+#define _RUN_WRITER_HPP
+
+#include "common.hpp"
+#include "config.hpp"
+#include "io_backend.hpp"
+#include "offset_index.hpp"
+#include "record.hpp"
+#include "run_format.hpp"
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <fcntl.h>
+#include <memory>
+#include <string>
+#include <sys/uio.h>
+#include <vector>
+
+/* Output buffers of a RunWriter, all but one can be in flight */
+static constexpr size_t RUN_WRITER_BUFFERS = 4;
+
+/**
+ * Sequential writer of serialized records to the end of a file, it replaces
+ * appendToFile for the runs, the merges and the final output.
+ * The buffers are allocated once and written with positioned writes, so a flush
+ * costs one request instead of a truncate, a mapping and an msync.
+ * The memory is split into RUN_WRITER_BUFFERS buffers: a full buffer is submitted
+ * to the backend (a ThreadBackend of its own if none is given) and filling continues
+ * in the next free one, so the caller only blocks when every other buffer is still
+ * being written. Records may be split across two buffers, since the output is a
+ * plain byte stream.
+ *
+ * With DIRECT_IO the file is written bypassing the page cache: only whole blocks
+ * are written, the partial block at the end of a buffer is carried to the next one,
+ * and close() writes the last block padded with zeros, then truncates the padding.
+ *
+ * The durability decides when the data is flushed to storage: never (temporary
+ * files), once in close(), or after every buffer written.
+ *
+ * A compressed writer produces the block-compressed format (see block_codec.hpp):
+ * the bytes appended are gathered in a block, which is compressed into the buffers
+ * when it is full, and close() adds the footer.
+ * A columnar writer gathers the records of a segment (see columnar_run.hpp) and writes
+ * its columns when it is full, so it can only be appended whole records.
+ * A plain writer can also follow the record boundaries in the bytes appended and
+ * write an offset index of the file (see offset_index.hpp) in close().
+ */
+struct RunWriter {
+    int fd;
+    IoBackend* io;
+    std::unique_ptr<IoBackend> owned_io; // Backend used when none is given
+    Durability durability;
+    bool direct = false;
+    off_t offset = 0;  // File offset of the first byte of the current buffer
+    size_t current = 0;
+    std::vector<IoBuffer> buffers;
+    std::vector<IoRequest> requests;
+    RunFormat format = RunFormat::Plain;
+    std::unique_ptr<char[]> block; // Bytes of the block being filled, with a compressed writer
+    size_t block_len = 0;
+    std::unique_ptr<char[]> packed; // Header and bytes of the last block compressed
+    uint64_t raw_bytes = 0;         // Bytes appended to the blocks or segments written so far
+    std::unique_ptr<ColumnarSegment> segment; // Records of the segment being filled, with a columnar writer
+    std::unique_ptr<OffsetIndexBuilder> index; // Offsets of the records appended, with an indexed writer
+    std::string index_target;                  // Data file the index is written for
+    char header[RECORD_HEADER_SIZE];           // Header split across two appends, gathered here
+    size_t header_len = 0;
+    size_t payload_left = 0;                   // Bytes of the payload of the last record still to be appended
+
+    /**
+     * @param fd The file to append to, it must be already open.
+     * @param memory The memory for the output buffers.
+     * @param io The backend, or nullptr to write with an I/O thread of its own.
+     * @param durability When the written data is flushed to storage.
+     * @param expected_bytes The bytes that will be written, preallocated if not 0.
+     * @param format The format of the file, see run_format.hpp.
+     */
+    RunWriter(int fd, size_t memory, IoBackend* io = nullptr, Durability durability = Durability::None,
+              size_t expected_bytes = 0, RunFormat format = RunFormat::Plain)
+        : fd(fd), io(io), durability(durability), format(format) {
+        if (!io) {
+            owned_io = std::make_unique<ThreadBackend>();
+            this->io = owned_io.get();
+        }
+        buffers.resize(RUN_WRITER_BUFFERS);
+        requests.resize(RUN_WRITER_BUFFERS);
+        for (auto& buffer : buffers)
+            buffer.reserve(alignUp(std::max<size_t>(memory / RUN_WRITER_BUFFERS, 2 * DIRECT_IO_ALIGNMENT)));
+
+        offset = lseek(fd, 0, SEEK_END);
+        if (offset < 0) {
+            std::cerr << "lseek failed: " << strerror(errno) << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        /* Direct writes must start on a block boundary */
+        direct = DIRECT_IO && offset == static_cast<off_t>(alignDown(offset)) && enableDirectIO(fd);
+
+        if (format == RunFormat::Compressed) {
+            block = std::make_unique<char[]>(RUN_BLOCK_SIZE);
+            packed = std::make_unique<char[]>(sizeof(BlockHeader) + lzBound(RUN_BLOCK_SIZE));
+        } else if (format == RunFormat::Columnar) {
+            segment = std::make_unique<ColumnarSegment>();
+        }
+
+        /* Reserve the blocks upfront without changing the size, it is fine if the file system can't */
+        if (expected_bytes > 0 && format == RunFormat::Plain)
+            fallocate(fd, FALLOC_FL_KEEP_SIZE, offset, alignUp(expected_bytes));
+    }
+
+    RunWriter(const RunWriter&) = delete;
+    RunWriter& operator=(const RunWriter&) = delete;
+
+    /* The buffers, to be registered with the backend before the first write */
+    void collectBuffers(std::vector<iovec>& iovecs, std::vector<int*>& indices) {
+        for (size_t i = 0; i < buffers.size(); i++) {
+            iovecs.push_back({buffers[i].data(), buffers[i].capacity()});
+            indices.push_back(&requests[i].buf_index);
+        }
+    }
+
+    bool empty() const { return buffers[current].empty(); }
+
+    /* Index the records of a plain file, close() writes the index next to data_filename */
+    void indexRecords(const std::string& data_filename, uint64_t interval) {
+        if (format != RunFormat::Plain) return;
+        index = std::make_unique<OffsetIndexBuilder>(interval);
+        index_target = data_filename;
+    }
+
+    /* Follow the record boundaries in the bytes appended, a record may come in several appends */
+    void trackRecords(const char* data, size_t bytes) {
+        while (bytes > 0) {
+            if (payload_left > 0) {
+                size_t n = std::min(payload_left, bytes);
+                payload_left -= n;
+                data += n;
+                bytes -= n;
+                continue;
+            }
+            const char* h = data;
+            if (header_len > 0 || bytes < RECORD_HEADER_SIZE) {
+                size_t n = std::min(RECORD_HEADER_SIZE - header_len, bytes);
+                std::memcpy(header + header_len, data, n);
+                header_len += n;
+                data += n;
+                bytes -= n;
+                if (header_len < RECORD_HEADER_SIZE) return;
+                h = header;
+                header_len = 0;
+            } else {
+                data += RECORD_HEADER_SIZE;
+                bytes -= RECORD_HEADER_SIZE;
+            }
+            uint32_t len;
+            std::memcpy(&len, h + sizeof(uint64_t), sizeof(len));
+            index->add(RECORD_HEADER_SIZE + len);
+            payload_left = len;
+        }
+    }
+
+    /* Append serialized records to the output */
+    void append(const char* data, size_t bytes) {
+        if (format == RunFormat::Plain) {
+            if (index) trackRecords(data, bytes);
+            appendBytes(data, bytes);
+            return;
+        }
+        if (format == RunFormat::Columnar) {
+            appendColumns(data, bytes);
+            return;
+        }
+        while (bytes > 0) {
+            size_t n = std::min(bytes, RUN_BLOCK_SIZE - block_len);
+            std::memcpy(block.get() + block_len, data, n);
+            block_len += n;
+            data += n;
+            bytes -= n;
+            if (block_len == RUN_BLOCK_SIZE)
+                packBlock();
+        }
+    }
+
+    /* Compress the current block into the buffers, it is stored as it is if it does not shrink */
+    void packBlock() {
+        BlockHeader header;
+        header.raw_len = static_cast<uint32_t>(block_len);
+        char* payload = packed.get() + sizeof(header);
+        header.stored_len = static_cast<uint32_t>(lzCompress(block.get(), block_len, payload));
+        if (header.stored_len >= header.raw_len) {
+            header.stored_len = header.raw_len;
+            std::memcpy(payload, block.get(), block_len);
+        }
+        std::memcpy(packed.get(), &header, sizeof(header));
+        appendBytes(packed.get(), sizeof(header) + header.stored_len);
+        raw_bytes += block_len;
+        block_len = 0;
+    }
+
+    /* Split whole serialized records into the columns of the segment */
+    void appendColumns(const char* data, size_t bytes) {
+        size_t p = 0;
+        while (p + RECORD_HEADER_SIZE <= bytes) {
+            uint64_t key;
+            uint32_t len;
+            std::memcpy(&key, data + p, sizeof(key));
+            std::memcpy(&len, data + p + sizeof(key), sizeof(len));
+            if (bytes - p - RECORD_HEADER_SIZE < len) break;
+            appendRecord(key, len, data + p + RECORD_HEADER_SIZE);
+            p += RECORD_HEADER_SIZE + len;
+        }
+        if (p != bytes) {
+            std::cerr << "A columnar run can only be appended whole records" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    /* Append a record given by its fields */
+    void appendRecord(uint64_t key, uint32_t len, const char* payload) {
+        if (format == RunFormat::Columnar) {
+            segment->add(key, len, payload);
+            if (segment->full())
+                packSegment();
+            return;
+        }
+        append(reinterpret_cast<const char*>(&key), sizeof(key));
+        append(reinterpret_cast<const char*>(&len), sizeof(len));
+        append(payload, len);
+    }
+
+    /* Write the columns of the current segment */
+    void packSegment() {
+        size_t columns_len = segment->encodeColumns();
+        appendBytes(segment->columns.data(), columns_len);
+        appendBytes(segment->payloads.data(), segment->payloads.size());
+        raw_bytes += segment->rawBytes();
+        segment->clear();
+    }
+
+    /* Copy bytes to the output, flushing every time the current buffer fills up */
+    void appendBytes(const char* data, size_t bytes) {
+        IoBuffer& buffer = buffers[current];
+        if (buffer.size() + bytes <= buffer.capacity()) {
+            buffer.insert(buffer.end(), data, data + bytes);
+            return;
+        }
+        while (bytes > 0) {
+            IoBuffer& buffer = buffers[current];
+            size_t n = std::min(bytes, buffer.capacity() - buffer.size());
+            buffer.insert(buffer.end(), data, data + n);
+            data += n;
+            bytes -= n;
+            if (buffers[current].size() == buffers[current].capacity())
+                flush();
+        }
+    }
+
+    /* Serialize a Record to the output */
+    void append(const Record& record) {
+        appendRecord(record.key, record.len, record.rpayload.get());
+    }
+
+    /* Write the current buffer (its whole blocks in direct mode) and move to the next free one */
+    void flush() {
+        IoBuffer& buffer = buffers[current];
+        size_t bytes = direct ? alignDown(buffer.size()) : buffer.size();
+        if (bytes > 0)
+            submitWrite(bytes);
+    }
+
+    /* Flush the last bytes, wait for all the writes and apply the durability */
+    void close() {
+        if (format == RunFormat::Compressed) {
+            if (block_len > 0) packBlock();
+            RunFooter footer = {raw_bytes, COMPRESSED_RUN_MAGIC};
+            appendBytes(reinterpret_cast<const char*>(&footer), sizeof(footer));
+        } else if (format == RunFormat::Columnar) {
+            if (!segment->empty()) packSegment();
+            RunFooter footer = {raw_bytes, COLUMNAR_RUN_MAGIC};
+            appendBytes(reinterpret_cast<const char*>(&footer), sizeof(footer));
+        }
+        flush();
+
+        size_t tail = buffers[current].size();
+        if (tail > 0) {
+            /* Only in direct mode: the last block is padded, then the padding is cut */
+            buffers[current].resize(alignUp(tail), 0);
+            submitWrite(buffers[current].size());
+        }
+        for (auto& req : requests)
+            wait(req);
+        if (tail > 0 && ftruncate(fd, offset - alignUp(tail) + tail) != 0) {
+            std::cerr << "ftruncate failed: " << strerror(errno) << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        if (durability != Durability::None)
+            sync();
+        if (index)
+            index->write(index_target);
+    }
+
+    /* Submit the first bytes of the current buffer, then wait for the next buffer to be free */
+    void submitWrite(size_t bytes) {
+        const size_t prev = current;
+        IoRequest& req = requests[prev];
+        req.fd = fd;
+        req.buf = buffers[prev].data();
+        req.len = bytes;
+        req.offset = offset;
+        req.write = true;
+        io->queue(&req);
+        io->submit();
+        offset += bytes;
+
+        current = (prev + 1) % buffers.size();
+        wait(requests[current]);
+        /* In direct mode the partial block goes at the start of the next buffer */
+        IoBuffer& buffer = buffers[prev];
+        buffers[current].insert(buffers[current].end(), buffer.data() + bytes, buffer.data() + buffer.size());
+
+        if (durability == Durability::PerBatch) {
+            wait(req);
+            sync();
+        }
+    }
+
+    /* Wait for the write of a buffer, which is then reused */
+    void wait(IoRequest& req) {
+        io->waitFor(&req);
+        if (req.done != req.len) {
+            std::cerr << "Short write: " << req.done << " of " << req.len << " bytes" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        buffers[&req - requests.data()].clear();
+    }
+
+    void sync() {
+        if (fdatasync(fd) != 0) {
+            std::cerr << "fdatasync failed: " << strerror(errno) << std::endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+};
+
+#endif // _RUN_WRITER_HPP
@@ -0,0 +1,246 @@
+#ifndef _SIMD_MERGE_HPP
+#define _SIMD_MERGE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+/**
+ * Merge kernels for sorted (key, index) lanes. Keys and indices are kept in two
+ * parallel arrays, so that a vector register holds 4 (AVX2) or 8 (AVX-512) keys
+ * and another one the matching indices. The kernel is picked once at runtime
+ * from the features of the CPU, falling back to a scalar merge.
+ */
+typedef void (*merge_kernel_t)(const unsigned long* ka, const uint64_t* ia, size_t na,
+                               const unsigned long* kb, const uint64_t* ib, size_t nb,
+                               unsigned long* ko, uint64_t* io);
+
+static void scalarMergeLanes(const unsigned long* ka, const uint64_t* ia, size_t na,
+                             const unsigned long* kb, const uint64_t* ib, size_t nb,
+                             unsigned long* ko, uint64_t* io) {
+    size_t i = 0, j = 0, o = 0;
+    /* Branchless selection, the outcome of the comparison is not predictable */
+    while (i < na && j < nb) {
+        bool take_b = kb[j] < ka[i];
+        ko[o] = take_b ? kb[j] : ka[i];
+        io[o] = take_b ? ib[j] : ia[i];
+        j += take_b;
+        i += !take_b;
+        o++;
+    }
+    for (; i < na; i++, o++) { ko[o] = ka[i]; io[o] = ia[i]; }
+    for (; j < nb; j++, o++) { ko[o] = kb[j]; io[o] = ib[j]; }
+}
+
+/**
+ * Finish a vectorized merge: the W lanes still in the registers (hk, hi) and the
+ * remaining elements of both inputs are all greater or equal than what was already
+ * written. At least one of the two inputs has less than W elements left, so it is
+ * merged with the register lanes first and the result with the other input.
+ */
+static void mergeLanesTail(const unsigned long* hk, const uint64_t* hi, size_t w,
+                           const unsigned long* ka, const uint64_t* ia, size_t na,
+                           const unsigned long* kb, const uint64_t* ib, size_t nb,
+                           unsigned long* ko, uint64_t* io, size_t max_small) {
+    unsigned long tk[32];
+    uint64_t ti[32];
+    if (na < max_small) {
+        scalarMergeLanes(hk, hi, w, ka, ia, na, tk, ti);
+        scalarMergeLanes(tk, ti, w + na, kb, ib, nb, ko, io);
+    } else {
+        scalarMergeLanes(hk, hi, w, kb, ib, nb, tk, ti);
+        scalarMergeLanes(tk, ti, w + nb, ka, ia, na, ko, io);
+    }
+}
+
+#if defined(__x86_64__)
+
+/* Lanes of the vectors are compared as unsigned, AVX2 only has the signed comparison */
+__attribute__((target("avx2")))
+static inline __m256i avx2CmpGtU64(__m256i a, __m256i b) {
+    const __m256i bias = _mm256_set1_epi64x(static_cast<long long>(1ULL << 63));
+    return _mm256_cmpgt_epi64(_mm256_xor_si256(a, bias), _mm256_xor_si256(b, bias));
+}
+
+/**
+ * One step of the bitonic network: every lane is compared with the lane selected by
+ * the permutation, low lanes keep the minimum and high lanes (high_mask) the maximum.
+ * The swap decision of a high lane is the one of its partner, so equal keys never
+ * duplicate an index.
+ */
+template<int PERM, int HIGH_MASK>
+__attribute__((target("avx2")))
+static inline void avx2BitonicStep(__m256i& k, __m256i& i) {
+    __m256i pk = _mm256_permute4x64_epi64(k, PERM);
+    __m256i pi = _mm256_permute4x64_epi64(i, PERM);
+    __m256i swap = _mm256_blend_epi32(avx2CmpGtU64(k, pk), avx2CmpGtU64(pk, k), HIGH_MASK);
+    k = _mm256_blendv_epi8(k, pk, swap);
+    i = _mm256_blendv_epi8(i, pi, swap);
+}
+
+/* Merge two sorted vectors: on return lk/li hold the 4 smallest lanes and hk/hi the 4 largest, both sorted */
+__attribute__((target("avx2")))
+static inline void avx2MergeNetwork(__m256i ak, __m256i ai, __m256i bk, __m256i bi,
+                                    __m256i& lk, __m256i& li, __m256i& hk, __m256i& hi) {
+    bk = _mm256_permute4x64_epi64(bk, _MM_SHUFFLE(0, 1, 2, 3));
+    bi = _mm256_permute4x64_epi64(bi, _MM_SHUFFLE(0, 1, 2, 3));
+    __m256i gt = avx2CmpGtU64(ak, bk);
+    lk = _mm256_blendv_epi8(ak, bk, gt);
+    li = _mm256_blendv_epi8(ai, bi, gt);
+    hk = _mm256_blendv_epi8(bk, ak, gt);
+    hi = _mm256_blendv_epi8(bi, ai, gt);
+    avx2BitonicStep<_MM_SHUFFLE(1, 0, 3, 2), 0xF0>(lk, li);
+    avx2BitonicStep<_MM_SHUFFLE(2, 3, 0, 1), 0xCC>(lk, li);
+    avx2BitonicStep<_MM_SHUFFLE(1, 0, 3, 2), 0xF0>(hk, hi);
+    avx2BitonicStep<_MM_SHUFFLE(2, 3, 0, 1), 0xCC>(hk, hi);
+}
+
+__attribute__((target("avx2")))
+static void avx2MergeLanes(const unsigned long* ka, const uint64_t* ia, size_t na,
+                           const unsigned long* kb, const uint64_t* ib, size_t nb,
+                           unsigned long* ko, uint64_t* io) {
+    constexpr size_t W = 4;
+    if (na < W || nb < W) {
+        scalarMergeLanes(ka, ia, na, kb, ib, nb, ko, io);
+        return;
+    }
+
+    __m256i lk, li, hk, hi;
+    avx2MergeNetwork(
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(ka)),
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(ia)),
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(kb)),
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(ib)),
+        lk, li, hk, hi);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(ko), lk);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(io), li);
+    size_t pa = W, pb = W, o = W;
+
+    /* The next vector comes from the input with the smallest head */
+    while (pa < na || pb < nb) {
+        bool take_a = pb >= nb || (pa < na && ka[pa] <= kb[pb]);
+        const unsigned long* nk;
+        const uint64_t* ni;
+        if (take_a) {
+            if (na - pa < W) break;
+            nk = ka + pa; ni = ia + pa; pa += W;
+        } else {
+            if (nb - pb < W) break;
+            nk = kb + pb; ni = ib + pb; pb += W;
+        }
+        avx2MergeNetwork(
+            _mm256_loadu_si256(reinterpret_cast<const __m256i*>(nk)),
+            _mm256_loadu_si256(reinterpret_cast<const __m256i*>(ni)),
+            hk, hi, lk, li, hk, hi);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(ko + o), lk);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(io + o), li);
+        o += W;
+    }
+
+    alignas(32) unsigned long rk[W];
+    alignas(32) uint64_t ri[W];
+    _mm256_store_si256(reinterpret_cast<__m256i*>(rk), hk);
+    _mm256_store_si256(reinterpret_cast<__m256i*>(ri), hi);
+    mergeLanesTail(rk, ri, W, ka + pa, ia + pa, na - pa, kb + pb, ib + pb, nb - pb, ko + o, io + o, W);
+}
+
+template<int HIGH_MASK>
+__attribute__((target("avx512f")))
+static inline void avx512BitonicStep(__m512i perm, __m512i& k, __m512i& i) {
+    __m512i pk = _mm512_permutex2var_epi64(k, perm, k);
+    __m512i pi = _mm512_permutex2var_epi64(i, perm, i);
+    __mmask8 swap = (_mm512_cmpgt_epu64_mask(k, pk) & ~HIGH_MASK)
+                  | (_mm512_cmpgt_epu64_mask(pk, k) & HIGH_MASK);
+    k = _mm512_mask_blend_epi64(swap, k, pk);
+    i = _mm512_mask_blend_epi64(swap, i, pi);
+}
+
+__attribute__((target("avx512f")))
+static inline void avx512MergeNetwork(__m512i ak, __m512i ai, __m512i bk, __m512i bi,
+                                      __m512i& lk, __m512i& li, __m512i& hk, __m512i& hi) {
+    const __m512i reverse = _mm512_set_epi64(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m512i d4 = _mm512_set_epi64(3, 2, 1, 0, 7, 6, 5, 4);
+    const __m512i d2 = _mm512_set_epi64(5, 4, 7, 6, 1, 0, 3, 2);
+    const __m512i d1 = _mm512_set_epi64(6, 7, 4, 5, 2, 3, 0, 1);
+    bk = _mm512_permutex2var_epi64(bk, reverse, bk);
+    bi = _mm512_permutex2var_epi64(bi, reverse, bi);
+    __mmask8 gt = _mm512_cmpgt_epu64_mask(ak, bk);
+    lk = _mm512_mask_blend_epi64(gt, ak, bk);
+    li = _mm512_mask_blend_epi64(gt, ai, bi);
+    hk = _mm512_mask_blend_epi64(gt, bk, ak);
+    hi = _mm512_mask_blend_epi64(gt, bi, ai);
+    avx512BitonicStep<0xF0>(d4, lk, li);
+    avx512BitonicStep<0xCC>(d2, lk, li);
+    avx512BitonicStep<0xAA>(d1, lk, li);
+    avx512BitonicStep<0xF0>(d4, hk, hi);
+    avx512BitonicStep<0xCC>(d2, hk, hi);
+    avx512BitonicStep<0xAA>(d1, hk, hi);
+}
+
+__attribute__((target("avx512f")))
+static void avx512MergeLanes(const unsigned long* ka, const uint64_t* ia, size_t na,
+                             const unsigned long* kb, const uint64_t* ib, size_t nb,
+                             unsigned long* ko, uint64_t* io) {
+    constexpr size_t W = 8;
+    if (na < W || nb < W) {
+        scalarMergeLanes(ka, ia, na, kb, ib, nb, ko, io);
+        return;
+    }
+
+    __m512i lk, li, hk, hi;
+    avx512MergeNetwork(_mm512_loadu_si512(ka), _mm512_loadu_si512(ia),
+                       _mm512_loadu_si512(kb), _mm512_loadu_si512(ib),
+                       lk, li, hk, hi);
+    _mm512_storeu_si512(ko, lk);
+    _mm512_storeu_si512(io, li);
+    size_t pa = W, pb = W, o = W;
+
+    while (pa < na || pb < nb) {
+        bool take_a = pb >= nb || (pa < na && ka[pa] <= kb[pb]);
+        const unsigned long* nk;
+        const uint64_t* ni;
+        if (take_a) {
+            if (na - pa < W) break;
+            nk = ka + pa; ni = ia + pa; pa += W;
+        } else {
+            if (nb - pb < W) break;
+            nk = kb + pb; ni = ib + pb; pb += W;
+        }
+        avx512MergeNetwork(_mm512_loadu_si512(nk), _mm512_loadu_si512(ni), hk, hi, lk, li, hk, hi);
+        _mm512_storeu_si512(ko + o, lk);
+        _mm512_storeu_si512(io + o, li);
+        o += W;
+    }
+
+    alignas(64) unsigned long rk[W];
+    alignas(64) uint64_t ri[W];
+    _mm512_store_si512(rk, hk);
+    _mm512_store_si512(ri, hi);
+    mergeLanesTail(rk, ri, W, ka + pa, ia + pa, na - pa, kb + pb, ib + pb, nb - pb, ko + o, io + o, W);
+}
+
+#endif // __x86_64__
+
+static merge_kernel_t selectMergeKernel() {
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return avx512MergeLanes;
+    if (__builtin_cpu_supports("avx2")) return avx2MergeLanes;
+#endif
+    return scalarMergeLanes;
+}
+
+/**
+ * Merge two sorted lane arrays into (ko, io), which must have room for na + nb lanes
+ * and must not overlap the inputs.
+ */
+static inline void mergeLanes(const unsigned long* ka, const uint64_t* ia, size_t na,
+                              const unsigned long* kb, const uint64_t* ib, size_t nb,
+                              unsigned long* ko, uint64_t* io) {
+    static const merge_kernel_t kernel = selectMergeKernel();
+    kernel(ka, ia, na, kb, ib, nb, ko, io);
+}
+
+#endif // _SIMD_MERGE_HPP
@@ -1,23 +1,37 @@
 #ifndef _SORTING_HPP
 #define _SORTING_HPP
 
+#include "block_codec.hpp"
+#include "columnar_run.hpp"
 #include "common.hpp"
 #include "hpc_helpers.hpp"
+#include "io_backend.hpp"
+#include "loser_tree.hpp"
+#include "merge_plan.hpp"
+#include "parallel_sort.hpp"
+#include "radix_sort.hpp"
+#include "record_boundaries.hpp"
+#include "simd_merge.hpp"
 #include "record.hpp"
+#include "run_format.hpp"
+#include "run_reader.hpp"
+#include "run_writer.hpp"
 #include <algorithm>
 #include <cassert>
+#include <climits>
 #include <cstddef>
 #include <cstring>
-#include <deque>
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <filesystem>
 #include <iostream>
 #include <omp.h>
 #include <queue>
 #include <string>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <thread>
 #include <unistd.h>
 #include <utility>
 #include <vector>
@@ -30,170 +44,694 @@ static inline std::string removeSubstring(std::string str, const std::string& to
     return str;
 }
 
+/* Sequential sort kernel, the radix engine is used when RADIX_SORT is set */
+template<typename T>
+static inline void sortTags(T* tags, size_t n) {
+    if (RADIX_SORT)
+        radixSortTags(tags, n);
+    else
+        std::sort(tags, tags + n);
+}
+
 /**
- * Merge two sorted files into a single output file.
- * It is used mainly in the parallel version of the algorithm.
- *
- * @param file1 The first input file.
- * @param file2 The second input file.
- * @param output_filename The output file.
- * @param max_mem The maximum memory available to read records from files.
+ * Sort the records of a chunk by key. Only the tags are moved around,
+ * the serialized records stay where they are in the slab or in the mapping,
+ * except for a FixedChunk whose records are sorted in place.
+ * With a thread budget greater than one, the chunk is sorted with a parallel sample sort.
  */
-static void mergeFiles(const std::string& file1, const std::string& file2,
-                       const std::string& output_filename, const ssize_t max_mem) {
-    std::deque<Record> buffer1;
-    std::deque<Record> buffer2;
-    std::deque<Record> output_buffer;
+template<typename Chunk>
+static inline void sortChunk(Chunk& chunk, unsigned int nthreads = 1) {
+    auto& entries = [&]() -> auto& {
+        if constexpr (is_fixed_chunk<Chunk>::value) return chunk.records;
+        else return chunk.tags;
+    }();
+    using Entry = typename std::remove_reference_t<decltype(entries)>::value_type;
 
-    size_t bytes_to_process1 = getFileSize(file1);
-    size_t bytes_to_process2 = getFileSize(file2);
-    size_t usable_mem = max_mem / 3;
+    if (nthreads > 1)
+        parallelSortTags(entries, nthreads, sortTags<Entry>);
+    else
+        sortTags(entries.data(), entries.size());
+}
 
-    size_t bytes_read1 = 0;
-    size_t bytes_read2 = 0;
-    size_t out_buf_size = 0;
-    size_t bytes_written = 0;
+/* Copies of the entries sortChunk takes as scratch: the parallel sample sort scatters them into one, the radix engine into another */
+static inline size_t sortScratchCopies(unsigned int nthreads) {
+    return (nthreads > 1 ? 1 : 0) + (RADIX_SORT ? 1 : 0);
+}
 
-    bool use_b1 = false;
+/**
+ * Chunks of a run generation loop that fit in usable_mem along with the scratch of their sort.
+ * The entries of a FixedChunk are its records, so a sort copying them takes as much as the chunk
+ * itself; the tags of the other chunks are small and fit in the margin left by genSequenceFilesSTL.
+ */
+template<typename Chunk>
+static inline size_t chunkShares(size_t chunks, unsigned int sort_threads) {
+    if constexpr (is_fixed_chunk<Chunk>::value) return chunks + sortScratchCopies(sort_threads);
+    else return chunks;
+}
 
-    int out_fd = openFile(output_filename);
-    int fd1 = openFile(file1);
-    int fd2 = openFile(file2);
-    bytes_read1 += readRecordsFromFile(fd1, buffer1, bytes_read1, usable_mem);
-    bytes_read2 += readRecordsFromFile(fd2, buffer2, bytes_read2, usable_mem);
+/* Room in front of a prefetched window for the partial record left in the previous one */
+static constexpr size_t PREFETCH_HEADROOM = 64 * 1024;
 
-    while (!buffer1.empty() || !buffer2.empty() ||
-               bytes_read1 < bytes_to_process1 || bytes_read2 < bytes_to_process2) {
-        if (buffer1.empty() && bytes_read1 < bytes_to_process1)
-            bytes_read1 += readRecordsFromFile(fd1, buffer1, bytes_read1, usable_mem);
+/**
+ * Read window over a sorted run used by the merges.
+ * The run is mapped once by a RunReader and read in place, usable_mem bytes at a time:
+ * keys are compared straight from the mapping and the bytes of a record are copied only
+ * once, into the output buffer. The window slides when the record at pos is not entirely
+ * inside it, which costs no system call, and the reader keeps the kernel reading ahead.
+ * With an I/O backend attached, the memory is split into two buffers read through it:
+ * while the merge consumes the window in one, the next window is read into the other.
+ * When the window slides, the partial record at its end is copied in front of the
+ * prefetched bytes, so the merge only waits if the prefetch is not complete yet.
+ * Each read is split into IO_QUEUE_DEPTH requests. With DIRECT_IO too, the reads
+ * bypass the page cache and are widened to whole blocks.
+ * A run in the block-compressed format is always read through its mapping, and its
+ * windows are decoded into two buffers the same way: the next one by a DecodeWorker,
+ * in the background, while the merge consumes the current one.
+ */
+struct BufferState {
+    int fd;
+    RunReader reader;
+    IoBackend* io = nullptr;
+    bool direct = false;
+    IoBufferPtr read_buffers[2];  // The window is in read_buffers[active], the next one is read into the other
+    int buf_indices[2] = {-1, -1}; // Indices of read_buffers in the registered buffers of io
+    size_t read_capacity = 0;
+    size_t active = 0;
+    size_t headroom = 0;          // Bytes in front of the data read into a buffer
+    IoRequest prefetch[IO_QUEUE_DEPTH];
+    size_t prefetch_count = 0;    // Requests of the prefetch, 0 if none is in flight
+    size_t prefetch_offset = 0;   // File offset of the first byte prefetched
+    size_t prefetch_len = 0;
+    size_t prefetch_skip = 0;     // Bytes read before prefetch_offset to align a direct read
+    const char* window = nullptr; // Bytes of the run starting at window_offset
+    size_t window_offset = 0;
+    size_t window_len = 0;
+    size_t pos = 0;               // Position of the current record in the window
+    size_t total_bytes = 0;
+    size_t file_index = 0;
+    size_t usable_mem = 0;
+    size_t read_size = 0;         // Bytes of a window, usable_mem or half of it with io
+    bool compressed = false;      // The run is in the block-compressed format
+    DecodeWorker* decoder = nullptr;
+    DecodeBuffer decoded[2];      // Like read_buffers, for the decoded windows
+    DecodeWorker::Job decode_job; // Decoding of the window after the current one
+    bool decoding = false;        // decode_job was posted and not waited for yet
+    size_t src_offset = 0;        // File offset of the next block to decode
+    size_t src_end = 0;           // File offset of the footer
 
+    /**
+     * A plain run can also be merged only over the region [begin, begin + bytes),
+     * which must start and end at record boundaries.
+     */
+    BufferState(int fd, std::string name, size_t index, size_t usable_mem, size_t begin = 0, size_t bytes = SIZE_MAX)
+        : fd(fd), reader(fd, begin, bytes), file_index(index), usable_mem(usable_mem), read_size(usable_mem),
+          compressed(isCompressedRun(name)) {
+            window_offset = reader.begin;
+            total_bytes = reader.begin + reader.length;
+            if (compressed) {
+                total_bytes = readRunFooter(fd, reader.length, COMPRESSED_RUN_MAGIC);
+                src_end = reader.length - sizeof(RunFooter);
+            }
+    }
 
+    BufferState(BufferState&& other) noexcept
+        : fd(other.fd), reader(std::move(other.reader)), io(other.io), direct(other.direct),
+          read_buffers{std::move(other.read_buffers[0]), std::move(other.read_buffers[1])},
+          buf_indices{other.buf_indices[0], other.buf_indices[1]}, read_capacity(other.read_capacity),
+          active(other.active), headroom(other.headroom), prefetch_count(other.prefetch_count),
+          prefetch_offset(other.prefetch_offset), prefetch_len(other.prefetch_len),
+          prefetch_skip(other.prefetch_skip), window(other.window),
+          window_offset(other.window_offset), window_len(other.window_len), pos(other.pos),
+          total_bytes(other.total_bytes), file_index(other.file_index), usable_mem(other.usable_mem),
+          read_size(other.read_size), compressed(other.compressed), decoder(other.decoder),
+          decoded{std::move(other.decoded[0]), std::move(other.decoded[1])}, decode_job(std::move(other.decode_job)),
+          decoding(other.decoding), src_offset(other.src_offset), src_end(other.src_end) {
+    }
 
-        if (buffer2.empty() && bytes_read2 < bytes_to_process2)
-            bytes_read2 += readRecordsFromFile(fd2, buffer2, bytes_read2, usable_mem);
+    BufferState(const BufferState&) = delete;
 
-        if (buffer1.empty()) use_b1 = false;
-        else if (buffer2.empty()) use_b1 = true;
-        else use_b1 = (buffer1.front() <= buffer2.front());
+    bool hasMoreData() const {
+        return !finished();
+    }
 
+    /* Read the windows through io, the buffers are allocated here so that they can be registered */
+    void attach(IoBackend* backend) {
+        io = backend;
+        direct = DIRECT_IO && enableDirectIO(fd);
+        read_size = std::max<size_t>(usable_mem / 2, 1);
+        const size_t window_bytes = std::max<size_t>(std::min(read_size, total_bytes), 1);
+        headroom = alignUp(std::min(window_bytes, PREFETCH_HEADROOM));
+        /* Room for the blocks a direct read is widened to */
+        read_capacity = headroom + alignUp(window_bytes) + DIRECT_IO_ALIGNMENT;
+        for (auto& buffer : read_buffers)
+            buffer = allocIoBuffer(read_capacity);
+    }
 
-        if (use_b1) {
-            Record r = buffer1.front();
-            out_buf_size += r.size();
-            output_buffer.push_back(std::move(buffer1.front()));
-            buffer1.pop_front();
-        } else {
-            Record r = buffer2.front();
-            out_buf_size += r.size();
-            output_buffer.push_back(std::move(buffer2.front()));
-            buffer2.pop_front();
+    /**
+     * Queue the reads of len bytes at offset into read_buffers[b], after its headroom,
+     * split in at most IO_QUEUE_DEPTH requests on block boundaries.
+     *
+     * @return The bytes read before offset to align a direct read.
+     */
+    size_t queueRead(size_t b, IoRequest* requests, size_t& nrequests, size_t offset, size_t len) {
+        const size_t skip = direct ? offset - alignDown(offset) : 0;
+        const size_t read_offset = offset - skip;
+        const size_t read_len = direct ? alignUp(skip + len) : len;
+        if (headroom + read_len > read_capacity) {
+            /* A record bigger than the window, the new buffer is not registered */
+            read_buffers[b] = allocIoBuffer(headroom + read_len);
+            buf_indices[b] = -1;
         }
 
-        if (out_buf_size >= usable_mem) {
-            bytes_written += appendToFile(out_fd, std::move(output_buffer), out_buf_size);
-            out_buf_size = 0;
-            output_buffer.clear();
+        /* The last request may stop at EOF */
+        const size_t nblocks = alignUp(read_len) / DIRECT_IO_ALIGNMENT;
+        nrequests = std::min<size_t>(IO_QUEUE_DEPTH, nblocks);
+        for (size_t r = 0; r < nrequests; r++) {
+            size_t begin = ((r * nblocks) / nrequests) * DIRECT_IO_ALIGNMENT;
+            size_t end = std::min(read_len, (((r + 1) * nblocks) / nrequests) * DIRECT_IO_ALIGNMENT);
+            requests[r].fd = fd;
+            requests[r].buf = read_buffers[b].get() + headroom + begin;
+            requests[r].len = end - begin;
+            requests[r].offset = read_offset + begin;
+            requests[r].write = false;
+            requests[r].buf_index = buf_indices[b];
+            io->queue(&requests[r]);
         }
+        return skip;
     }
 
-    if (!output_buffer.empty())
-        bytes_written += appendToFile(out_fd, std::move(output_buffer), out_buf_size);
+    /* Wait for the reads, only the ones reaching EOF may be short */
+    void waitReads(IoRequest* requests, size_t nrequests) {
+        for (size_t r = 0; r < nrequests; r++) {
+            io->waitFor(&requests[r]);
+            size_t expected = std::min(requests[r].len, total_bytes - std::min<size_t>(requests[r].offset, total_bytes));
+            if (requests[r].done != expected) {
+                std::cerr << "Short read: " << requests[r].done << " of " << expected << " bytes" << std::endl;
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
 
+    /* Start reading the bytes after the window into the idle buffer */
+    void startPrefetch() {
+        prefetch_offset = window_offset + window_len;
+        prefetch_len = std::min(read_size, total_bytes - prefetch_offset);
+        if (prefetch_len == 0) return;
+        prefetch_skip = queueRead(active ^ 1, prefetch, prefetch_count, prefetch_offset, prefetch_len);
+        io->submit();
+    }
 
-    close(fd1);
-    close(fd2);
-    close(out_fd);
-    deleteFile(file1.c_str());
-    deleteFile(file2.c_str());
-}
+    /**
+     * Wait for the prefetch and make it the window, with the len bytes from offset
+     * still needed (the first ones at tail, in the old window) moved in front of it.
+     *
+     * @return Whether the prefetched bytes could be used, otherwise they are dropped.
+     */
+    bool takePrefetch(const char* tail, size_t offset, size_t len) {
+        waitReads(prefetch, prefetch_count);
+        prefetch_count = 0;
+        const size_t tail_len = prefetch_offset - offset;
+        if (offset > prefetch_offset || tail_len > headroom + prefetch_skip || tail_len + prefetch_len < len)
+            return false;
 
-struct BufferState {
-    int fd;
-    std::deque<Record> buffer;
-    size_t bytes_read = 0;
-    size_t total_bytes = 0;
-    size_t file_index = 0;
-    size_t usable_mem = 0;
-    size_t available_mem = 0;
+        active ^= 1;
+        char* data = read_buffers[active].get() + headroom + prefetch_skip;
+        std::memcpy(data - tail_len, tail, tail_len);
+        window = data - tail_len;
+        window_len = tail_len + prefetch_len;
+        return true;
+    }
 
-    BufferState(int fd, std::string name, size_t index, size_t usable_mem)
-        : fd(fd), file_index(index), usable_mem(usable_mem), available_mem(usable_mem) {
-            total_bytes = getFileSize(name);
+    /* Decode the windows of a compressed run with the background worker */
+    void attachDecoder(DecodeWorker* worker) {
+        decoder = worker;
+        read_size = std::max<size_t>(usable_mem / 2, 1);
+        headroom = std::min(read_size, PREFETCH_HEADROOM);
+        for (auto& buffer : decoded)
+            buffer.reserve(headroom + read_size + RUN_BLOCK_SIZE);
     }
 
-    bool hasMoreData() const {
-        return !buffer.empty() || bytes_read < total_bytes;
+    /* Decode the next block of the run at the end of buffer */
+    void decodeBlock(DecodeBuffer& buffer) {
+        BlockHeader header;
+        if (src_offset + sizeof(header) > src_end) {
+            std::cerr << "Truncated block in a compressed run" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        std::memcpy(&header, reader.view(src_offset, sizeof(header)), sizeof(header));
+        const size_t stored_offset = src_offset + sizeof(header);
+        if (header.stored_len > src_end - stored_offset) {
+            std::cerr << "Truncated block in a compressed run" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        const char* stored = reader.view(stored_offset, header.stored_len);
+        buffer.reserve(buffer.size + header.raw_len);
+        char* out = buffer.data.get() + buffer.size;
+        if (header.stored_len == header.raw_len)
+            std::memcpy(out, stored, header.raw_len);
+        else if (!lzDecompress(stored, header.stored_len, out, header.raw_len)) {
+            std::cerr << "Corrupted block in a compressed run" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        buffer.size += header.raw_len;
+        src_offset = stored_offset + header.stored_len;
     }
 
+    /* Decode whole blocks after the headroom of decoded[b], until a window is there or the run ends */
+    void decodeAhead(size_t b) {
+        decoded[b].size = headroom;
+        while (decoded[b].size - headroom < read_size && src_offset < src_end)
+            decodeBlock(decoded[b]);
+    }
+
+    /**
+     * Make the decoded bytes after the window the new window, with the partial record
+     * at the end of the old one moved in front of them, then start decoding the next one.
+     */
+    void refillDecoded() {
+        const size_t next = active ^ 1;
+        if (decoding)
+            decoder->wait(&decode_job);
+        else
+            decodeAhead(next);
+        decoding = false;
+
+        DecodeBuffer& buffer = decoded[next];
+        const size_t tail_len = window_len - pos;
+        size_t start = headroom - std::min(headroom, tail_len);
+        if (tail_len > headroom) {
+            /* A record bigger than the headroom, the decoded bytes are shifted to make room */
+            const size_t shift = tail_len - headroom;
+            buffer.reserve(buffer.size + shift);
+            std::memmove(buffer.data.get() + tail_len, buffer.data.get() + headroom, buffer.size - headroom);
+            buffer.size += shift;
+        }
+        if (tail_len > 0)
+            std::memcpy(buffer.data.get() + start, window + pos, tail_len);
+        window_offset += pos;
+        pos = 0;
+        active = next;
+
+        window = buffer.data.get() + start;
+        window_len = buffer.size - start;
+        while (!wholeAt(0) && src_offset < src_end) {
+            decodeBlock(buffer);
+            window = buffer.data.get() + start;
+            window_len = buffer.size - start;
+        }
+
+        if (src_offset < src_end) {
+            const size_t idle = active ^ 1;
+            decode_job.run = [this, idle] { decodeAhead(idle); };
+            decoder->post(&decode_job);
+            decoding = true;
+        }
+    }
+
+    /* Slide (or read) the next window, starting from the current record */
     void refill() {
-        size_t last_read = readRecordsFromFile(
-            fd, buffer, bytes_read, std::min(available_mem, usable_mem));
-        bytes_read += last_read;
-        available_mem -= last_read;
+        if (decoder) {
+            refillDecoded();
+            return;
+        }
+        size_t offset = window_offset + pos;
+        size_t len = std::min(read_size, total_bytes - offset);
+
+        /* A single record bigger than the window still has to fit */
+        uint32_t record_len;
+        if (pos + RECORD_HEADER_SIZE <= window_len)
+            len = std::max(len, recordSizeAt(pos));
+        else if (len > 0 && pread(fd, &record_len, sizeof(record_len), offset + sizeof(uint64_t)) == sizeof(record_len))
+            len = std::max(len, std::min<size_t>(RECORD_HEADER_SIZE + record_len, total_bytes - offset));
+
+        if (io) {
+            bool prefetched = prefetch_count > 0 && takePrefetch(window + pos, offset, len);
+            window_offset = offset;
+            pos = 0;
+            if (!prefetched) {
+                window_len = 0;
+                if (len == 0) return;
+                IoRequest requests[IO_QUEUE_DEPTH];
+                size_t nrequests = 0;
+                size_t skip = queueRead(active, requests, nrequests, offset, len);
+                io->submit();
+                waitReads(requests, nrequests);
+                window = read_buffers[active].get() + headroom + skip;
+                window_len = len;
+            }
+            startPrefetch();
+            return;
+        }
+
+        window_offset = offset;
+        window_len = len;
+        pos = 0;
+        if (len > 0)
+            window = reader.view(offset, len);
+    }
+
+    unsigned long keyAt(size_t p) const {
+        unsigned long key;
+        std::memcpy(&key, window + p, sizeof(key));
+        return key;
+    }
+
+    size_t recordSizeAt(size_t p) const {
+        uint32_t len;
+        std::memcpy(&len, window + p + sizeof(uint64_t), sizeof(len));
+        return RECORD_HEADER_SIZE + len;
+    }
+
+    /* Whether the record starting at p is entirely inside the window */
+    bool wholeAt(size_t p) const {
+        return p + RECORD_HEADER_SIZE <= window_len && p + recordSizeAt(p) <= window_len;
     }
 
     bool empty() const {
-        return buffer.empty();
+        return !wholeAt(pos);
     }
 
     bool finished() const {
-        return bytes_read == total_bytes;
+        return window_offset + pos == total_bytes;
     }
 
-    Record get_front() {
-        Record record = std::move(buffer.front());
-        buffer.pop_front();
-        available_mem += record.size();
-        return record;
+    unsigned long front_key() const {
+        return keyAt(pos);
+    }
+
+    size_t front_size() const {
+        return recordSizeAt(pos);
+    }
+
+    /**
+     * End of the span of whole records from pos whose keys are not greater than bound.
+     * With fixed length records it is found with an exponential search followed by
+     * a binary one, otherwise the headers have to be walked.
+     */
+    size_t gallop(unsigned long bound) const {
+        if (RECORD_STRIDE) {
+            const size_t n = (window_len - pos) / RECORD_STRIDE;
+            auto key = [&](size_t i) { return keyAt(pos + i * RECORD_STRIDE); };
+            /* First i in [lo, hi) with key(i) > bound, all the records before lo are taken */
+            size_t lo = 0, step = 1;
+            while (lo + step <= n && key(lo + step - 1) <= bound) {
+                lo += step;
+                step *= 2;
+            }
+            size_t hi = std::min(lo + step - 1, n);
+            while (lo < hi) {
+                size_t mid = lo + (hi - lo) / 2;
+                if (key(mid) <= bound) lo = mid + 1;
+                else hi = mid;
+            }
+            return pos + lo * RECORD_STRIDE;
+        }
+
+        size_t p = pos;
+        while (wholeAt(p) && keyAt(p) <= bound)
+            p += recordSizeAt(p);
+        return p;
+    }
+
+    /* Copy the bytes of the front record to the output and move to the next one */
+    template<typename Output>
+    void move_front(Output& out) {
+        size_t record_size = recordSizeAt(pos);
+        out.append(window + pos, record_size);
+        pos += record_size;
     }
 
     void close_fd() {
+        /* A prefetch still in flight must not outlive the buffers */
+        for (size_t r = 0; r < prefetch_count; r++)
+            io->waitFor(&prefetch[r]);
+        prefetch_count = 0;
+        if (decoding)
+            decoder->wait(&decode_job);
+        decoding = false;
         close(fd);
     }
 };
 
+/* The loser tree merge gallops after this many consecutive records from the same input */
+static constexpr size_t GALLOP_MIN_STREAK = 8;
+/* The lane merge copies a galloped span directly only if it is at least this big */
+static constexpr size_t GALLOP_MIN_BYTES = 4096;
+
+/* Upper bound on the records merged by one batch, it keeps the lanes scratch small */
+static constexpr size_t MERGE_BATCH_RECORDS = 1 << 16;
+/* Up to this many inputs, kWayMergeFiles merges batches with a tree of 2-way lane merges */
+static constexpr size_t LANE_MERGE_MAX_FANIN = 16;
+/* Lane indices store the buffer in the high bits and the record position in its window in the low ones */
+static constexpr unsigned int LANE_POS_BITS = 40;
+static constexpr uint64_t LANE_POS_MASK = (1ULL << LANE_POS_BITS) - 1;
 
 /**
- * This function performs k-way merge of sorted files into a single output file.
- * It is used in the sequential version of the merge sort.
- *
- * @param input_files The input file names.
- * @param output_filename The output file name.
- * @param max_mem The maximum memory available for sorting.
+ * Merge the buffered records of all the inputs in batches, using the SIMD lane kernels.
+ * Every window is walked in place for at most its share of MERGE_BATCH_RECORDS records.
+ * The batch then keeps the records up to a bound that no unread record can precede:
+ * the smallest last walked key among the inputs that have more data after it.
+ * The (key, position) lanes of the batch are merged with a tree of 2-way merges, then
+ * the records are gathered into the output, which writes its buffer out when it is full.
+ * Before each batch, the records of the smallest input that precede the front of every
+ * other input are galloped over: if they are enough, they are copied as a single span.
  */
-static void kWayMergeFiles(const std::vector<std::string>& input_files,
-                           const std::string& output_filename,
-                           const ssize_t max_mem) {
-    size_t num_files = input_files.size();
-    size_t out_buffer_memory = max_mem / 3;
+template<typename Output>
+static void laneMergeBuffers(std::vector<BufferState>& buffers, Output& out) {
+    const size_t per_input = std::max<size_t>(MERGE_BATCH_RECORDS / buffers.size(), 1);
+    std::vector<unsigned long> keys[2];
+    std::vector<uint64_t> idx[2];
+    std::vector<size_t> run_start, run_end;
 
-    /* Considering that I'm testing with at max 64 bytes payload, 4k are enough */
-    size_t usable_mem = std::max((max_mem - out_buffer_memory) / num_files, 4096UL);
-    std::vector<BufferState> buffers;
-    buffers.reserve(num_files);
+    while (true) {
+        /* Find the smallest front key and the runner-up among the other inputs */
+        size_t first = buffers.size();
+        unsigned long runner_up = ULONG_MAX;
+        for (size_t i = 0; i < buffers.size(); i++) {
+            BufferState& b = buffers[i];
+            if (b.empty() && !b.finished())
+                b.refill();
+            if (b.empty()) continue;
+            if (first == buffers.size() || b.front_key() < buffers[first].front_key()) {
+                if (first != buffers.size())
+                    runner_up = std::min(runner_up, buffers[first].front_key());
+                first = i;
+            } else {
+                runner_up = std::min(runner_up, b.front_key());
+            }
+        }
+        if (first != buffers.size()) {
+            BufferState& b = buffers[first];
+            size_t end = b.gallop(runner_up);
+            if (end - b.pos >= GALLOP_MIN_BYTES) {
+                out.append(b.window + b.pos, end - b.pos);
+                b.pos = end;
+                continue;
+            }
+        }
 
-    /* Initialize all buffer states */
-    for (size_t i = 0; i < num_files; i++) {
-        buffers.emplace_back(openFile(input_files[i]), input_files[i], i, usable_mem);
-        buffers[i].refill();
+        unsigned long bound = ULONG_MAX;
+        keys[0].clear();
+        idx[0].clear();
+        run_start.clear();
+        run_end.clear();
+
+        /* Collect the lanes of every window as a sorted run */
+        for (size_t i = 0; i < buffers.size(); i++) {
+            BufferState& b = buffers[i];
+            if (b.empty() && !b.finished())
+                b.refill();
+
+            run_start.push_back(keys[0].size());
+            size_t p = b.pos;
+            for (size_t n = 0; n < per_input && b.wholeAt(p); n++) {
+                keys[0].push_back(b.keyAt(p));
+                idx[0].push_back((static_cast<uint64_t>(i) << LANE_POS_BITS) | p);
+                p += b.recordSizeAt(p);
+            }
+            run_end.push_back(keys[0].size());
+
+            /* Records after the walked ones can't be merged before the last walked key */
+            if (run_end.back() > run_start.back() && b.window_offset + p < b.total_bytes)
+                bound = std::min(bound, keys[0].back());
+        }
+        if (keys[0].empty()) break;
+
+        /* Trim every run to the bound and compact the lanes */
+        size_t total = 0;
+        std::vector<size_t> starts;
+        for (size_t r = 0; r < run_start.size(); r++) {
+            auto first = keys[0].begin() + run_start[r];
+            size_t taken = std::upper_bound(first, keys[0].begin() + run_end[r], bound) - first;
+            if (!taken) continue;
+            std::move(first, first + taken, keys[0].begin() + total);
+            std::move(idx[0].begin() + run_start[r], idx[0].begin() + run_start[r] + taken, idx[0].begin() + total);
+            starts.push_back(total);
+            total += taken;
+
+            /* The window moves past the last record taken from it */
+            uint64_t last = idx[0][total - 1];
+            BufferState& b = buffers[last >> LANE_POS_BITS];
+            b.pos = (last & LANE_POS_MASK) + b.recordSizeAt(last & LANE_POS_MASK);
+        }
+        starts.push_back(total);
+        keys[1].resize(total);
+        idx[1].resize(total);
+
+        /* Merge adjacent runs until one is left */
+        int src = 0;
+        while (starts.size() > 2) {
+            size_t next = 0;
+            for (size_t r = 0; r + 1 < starts.size(); r += 2) {
+                size_t a = starts[r], b = starts[r + 1];
+                size_t end = (r + 2 < starts.size()) ? starts[r + 2] : b;
+                mergeLanes(keys[src].data() + a, idx[src].data() + a, b - a,
+                           keys[src].data() + b, idx[src].data() + b, end - b,
+                           keys[1 - src].data() + a, idx[1 - src].data() + a);
+                starts[next++] = a;
+            }
+            starts[next++] = total;
+            starts.resize(next);
+            src = 1 - src;
+        }
+
+        for (size_t j = 0; j < total; j++) {
+            const BufferState& b = buffers[idx[src][j] >> LANE_POS_BITS];
+            size_t p = idx[src][j] & LANE_POS_MASK;
+            out.append(b.window + p, b.recordSizeAt(p));
+        }
     }
+}
 
-    std::priority_queue<
-               std::pair<Record, size_t>,
-               std::vector<std::pair<Record, size_t>>,
-               HeapPairRecordComparator
-           > min_heap;
+/**
+ * Merge the inputs one record at a time, selecting the next one with a loser tree
+ * over the key of the front record of each window. This is the path for large fan-ins.
+ * When the same input wins GALLOP_MIN_STREAK times in a row, all its records up to
+ * the key of the runner-up are found with BufferState::gallop and copied at once.
+ */
+template<typename Output>
+static void loserTreeMergeBuffers(std::vector<BufferState>& buffers, Output& out) {
+    std::vector<unsigned long> keys(buffers.size(), 0);
+    std::vector<bool> done(buffers.size());
+    for (size_t i = 0; i < buffers.size(); i++) {
+        if (buffers[i].empty() && !buffers[i].finished())
+            buffers[i].refill();
+        done[i] = buffers[i].empty();
+        if (!done[i]) keys[i] = buffers[i].front_key();
+    }
 
-    /* Initialize the heap */
-    for (size_t i = 0; i < num_files; i++) {
-        if (!buffers[i].empty()) {
-            min_heap.emplace(buffers[i].get_front(), i);
+    LoserTree tree;
+    tree.init(keys, done);
+
+    size_t last_winner = buffers.size(), streak = 0;
+    while (!tree.empty()) {
+        BufferState& b = buffers[tree.winner()];
+        streak = (tree.winner() == last_winner) ? streak + 1 : 0;
+        last_winner = tree.winner();
+
+        if (streak >= GALLOP_MIN_STREAK) {
+            size_t end = b.gallop(tree.runnerUpKey());
+            out.append(b.window + b.pos, end - b.pos);
+            b.pos = end;
+        } else {
+            b.move_front(out);
         }
+
+        /* Slide the window if the next record is not entirely mapped */
+        if (b.empty() && !b.finished()) {
+            b.refill();
+        }
+
+        if (!b.empty())
+            tree.replay(b.front_key());
+        else
+            tree.exhaust();
     }
+}
 
-    std::deque<Record> output_buffer;
-    size_t out_buf_size = 0;
-    size_t bytes_written = 0;
+/**
+ * Make the inputs and the output of a merge go through io, if there is one.
+ * All their buffers are registered with the backend at once, so that the kernel
+ * does not have to pin the pages again at every request.
+ */
+static void attachIoBackend(std::vector<BufferState>& buffers, RunWriter& out, IoBackend* io) {
+    if (!io) return;
+    std::vector<iovec> iovecs;
+    std::vector<int*> indices;
+    for (BufferState& b : buffers) {
+        if (b.compressed) continue;
+        b.attach(io);
+        for (size_t i = 0; i < 2; i++) {
+            iovecs.push_back({b.read_buffers[i].get(), b.read_capacity});
+            indices.push_back(&b.buf_indices[i]);
+        }
+    }
+    out.collectBuffers(iovecs, indices);
+
+    if (io->registerBuffers(iovecs))
+        for (size_t i = 0; i < indices.size(); i++)
+            *indices[i] = static_cast<int>(i);
+}
+
+/* Decode the compressed inputs of a merge in the background, nullptr if there are none */
+static std::unique_ptr<DecodeWorker> attachDecoder(std::vector<BufferState>& buffers) {
+    std::unique_ptr<DecodeWorker> decoder;
+    for (BufferState& b : buffers) {
+        if (!b.compressed) continue;
+        if (!decoder) decoder = std::make_unique<DecodeWorker>();
+        b.attachDecoder(decoder.get());
+    }
+    return decoder;
+}
+
+/**
+ * Merge runs in the columnar format with a loser tree over the front keys of the cursors.
+ * The winner writes out at once all its records up to the key of the runner-up, found
+ * in its dense key column, and only then are their payloads read.
+ */
+static void columnarMergeCursors(std::vector<ColumnarCursor>& cursors, RunWriter& out) {
+    std::vector<unsigned long> keys(cursors.size(), 0);
+    std::vector<bool> done(cursors.size());
+    for (size_t i = 0; i < cursors.size(); i++) {
+        done[i] = cursors[i].empty();
+        if (!done[i]) keys[i] = cursors[i].key();
+    }
+
+    LoserTree tree;
+    tree.init(keys, done);
+    auto append = [&out](uint64_t key, uint32_t len, const char* payload) { out.appendRecord(key, len, payload); };
+    while (!tree.empty()) {
+        ColumnarCursor& c = cursors[tree.winner()];
+        c.emit(c.gallop(tree.runnerUpKey()), append);
+        if (!c.empty())
+            tree.replay(c.key());
+        else
+            tree.exhaust();
+    }
+}
+
+/**
+ * Merge runs in the columnar format into a single output file, in the columnar format
+ * too if it is a temporary one, and delete them. The input windows are the mappings
+ * of the runs, all the memory goes to the output buffers.
+ *
+ * @param durability When the output is flushed to storage, None for the intermediate merges.
+ */
+static void columnarMergeFiles(const std::vector<std::string>& input_files,
+                               const std::string& output_filename,
+                               size_t out_buffer_memory,
+                               Durability durability) {
+    std::vector<ColumnarCursor> cursors;
+    cursors.reserve(input_files.size());
+    size_t total_bytes = 0;
+    for (const auto& f : input_files) {
+        if (!isColumnarRun(f)) {
+            std::cerr << "Can't merge " << f << " with runs in the columnar format" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        cursors.emplace_back(openFile(f));
+        total_bytes += cursors.back().total_bytes;
+    }
 
     int out_fd = open(output_filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
     if (out_fd < 0) {
@@ -201,33 +739,104 @@ static void kWayMergeFiles(const std::vector<std::string>& input_files,
                   << " " << strerror(errno) << std::endl;
         exit(EXIT_FAILURE);
     }
+    std::unique_ptr<IoBackend> io = makeIoBackend();
+    RunWriter out(out_fd, out_buffer_memory, io.get(), durability, total_bytes, runFormat(output_filename));
+    columnarMergeCursors(cursors, out);
+    out.close();
 
-    while (!min_heap.empty()) {
-        auto [record, idx] = min_heap.top();
-        min_heap.pop();
+    close(out_fd);
+    for (ColumnarCursor& c : cursors)
+        close(c.fd);
+    for (const auto& f : input_files)
+        deleteRun(f);
+}
 
-        out_buf_size += record.size();
-        output_buffer.push_back(std::move(record));
+/**
+ * Merge two sorted files into a single output file.
+ * It is used mainly in the parallel version of the algorithm.
+ *
+ * @param file1 The first input file.
+ * @param file2 The second input file.
+ * @param output_filename The output file.
+ * @param max_mem The maximum memory available to read records from files.
+ * @param durability When the output is flushed to storage, None for the intermediate merges.
+ */
+static void mergeFiles(const std::string& file1, const std::string& file2,
+                       const std::string& output_filename, const ssize_t max_mem,
+                       Durability durability = Durability::None) {
+    if (isColumnarRun(file1)) {
+        columnarMergeFiles({file1, file2}, output_filename, max_mem / 3, durability);
+        return;
+    }
+    size_t usable_mem = max_mem / 3;
+    std::vector<BufferState> buffers;
+    buffers.reserve(2);
+    buffers.emplace_back(openFile(file1), file1, 0, usable_mem);
+    buffers.emplace_back(openFile(file2), file2, 1, usable_mem);
+    int out_fd = openFile(output_filename);
+    std::unique_ptr<IoBackend> io = makeIoBackend();
+    RunWriter out(out_fd, usable_mem, io.get(), durability, buffers[0].total_bytes + buffers[1].total_bytes,
+                  runFormat(output_filename));
+    attachIoBackend(buffers, out, io.get());
+    std::unique_ptr<DecodeWorker> decoder = attachDecoder(buffers);
 
-        /* Refill the buffer from the corresponding file if needed */
-        if (buffers[idx].empty() && !buffers[idx].finished()) {
-            buffers[idx].refill();
-        }
+    laneMergeBuffers(buffers, out);
+    out.close();
 
-        if (!buffers[idx].empty()) {
-            min_heap.emplace(buffers[idx].get_front(), idx);
-        }
+    for (BufferState& buffer : buffers)
+        buffer.close_fd();
+    close(out_fd);
+    deleteRun(file1);
+    deleteRun(file2);
+}
 
-        if (out_buf_size >= out_buffer_memory) {
-            bytes_written += appendToFile(out_fd, std::move(output_buffer), out_buf_size);
-            output_buffer.clear();
-            out_buf_size = 0;
-        }
+/**
+ * A single k-way merge of sorted files into an output file, with all the inputs
+ * open at once, see kWayMergeFiles.
+ */
+static void kWayMergePass(const std::vector<std::string>& input_files,
+                          const std::string& output_filename,
+                          const ssize_t max_mem,
+                          Durability durability,
+                          bool index_output) {
+    size_t num_files = input_files.size();
+    size_t out_buffer_memory = max_mem / 3;
+    if (isColumnarRun(input_files[0])) {
+        columnarMergeFiles(input_files, output_filename, out_buffer_memory, durability);
+        return;
     }
 
-    if (!output_buffer.empty()) {
-        bytes_written += appendToFile(out_fd, std::move(output_buffer), out_buf_size);
+    /* Considering that I'm testing with at max 64 bytes payload, 4k are enough */
+    size_t usable_mem = std::max((max_mem - out_buffer_memory) / num_files, 4096UL);
+    std::vector<BufferState> buffers;
+    buffers.reserve(num_files);
+
+    /* Initialize all buffer states, the windows are mapped by the merge */
+    size_t total_bytes = 0;
+    for (size_t i = 0; i < num_files; i++) {
+        buffers.emplace_back(openFile(input_files[i]), input_files[i], i, usable_mem);
+        total_bytes += buffers.back().total_bytes;
+    }
+
+    int out_fd = open(output_filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (out_fd < 0) {
+        std::cerr << "Error opening output file: " << output_filename
+                  << " " << strerror(errno) << std::endl;
+        exit(EXIT_FAILURE);
     }
+    std::unique_ptr<IoBackend> io = makeIoBackend();
+    RunWriter out(out_fd, out_buffer_memory, io.get(), durability, total_bytes, runFormat(output_filename));
+    if (index_output)
+        out.indexRecords(output_filename, RUN_INDEX_INTERVAL);
+    attachIoBackend(buffers, out, io.get());
+    std::unique_ptr<DecodeWorker> decoder = attachDecoder(buffers);
+
+    /* With few inputs, the tree of lane merges does only a handful of passes over each batch */
+    if (num_files <= LANE_MERGE_MAX_FANIN)
+        laneMergeBuffers(buffers, out);
+    else
+        loserTreeMergeBuffers(buffers, out);
+    out.close();
 
     close(out_fd);
     for (BufferState& buffer : buffers) {
@@ -236,7 +845,78 @@ static void kWayMergeFiles(const std::vector<std::string>& input_files,
 
     /* Delete all input files */
     for (const auto& f : input_files)
-        deleteFile(f.c_str());
+        deleteRun(f);
+}
+
+/**
+ * Run sequentially all the merges of the plan of the files (see merge_plan.hpp) but the
+ * last one, writing their outputs next to output_filename, indexed in case the last merge
+ * is a partitioned one.
+ *
+ * @return The inputs of the last merge, at most fan_in files.
+ */
+static std::vector<std::string> mergeDownTo(const std::vector<std::string>& input_files, size_t fan_in,
+                                            size_t max_mem, const std::string& output_filename) {
+    if (input_files.size() <= fan_in) return input_files;
+    std::vector<size_t> sizes;
+    for (const auto& f : input_files)
+        sizes.push_back(getFileSize(f));
+    const MergePlan plan = planMerges(sizes, fan_in);
+
+    std::vector<std::string> files(input_files);
+    auto inputsOf = [&](const MergeStep& step) {
+        std::vector<std::string> inputs;
+        for (size_t node : step.inputs)
+            inputs.push_back(files[node]);
+        return inputs;
+    };
+    for (size_t s = 0; s + 1 < plan.steps.size(); s++) {
+        files.push_back(runFileName(output_filename + ".pass#" + generateUUID(), MERGE_TIER));
+        kWayMergePass(inputsOf(plan.steps[s]), files.back(), max_mem, Durability::None, true);
+    }
+    return inputsOf(plan.steps.back());
+}
+
+/**
+ * This function performs k-way merge of sorted files into a single output file.
+ * It is used in the sequential version of the merge sort.
+ * When there are more files than a merge can take (see mergeFanIn), the smallest ones
+ * are merged first, in as many passes as the optimal merge pattern needs.
+ *
+ * @param input_files The input file names.
+ * @param output_filename The output file name.
+ * @param max_mem The maximum memory available for sorting.
+ * @param durability When the output is flushed to storage, None for the intermediate merges.
+ * @param index_output Whether to write an offset index of the output, for a partitioned merge of it.
+ */
+static void kWayMergeFiles(const std::vector<std::string>& input_files,
+                           const std::string& output_filename,
+                           const ssize_t max_mem,
+                           Durability durability = Durability::None,
+                           bool index_output = false) {
+    const size_t fan_in = mergeFanIn(max_mem, openFileBudget());
+    kWayMergePass(mergeDownTo(input_files, fan_in, max_mem, output_filename), output_filename, max_mem,
+                  durability, index_output);
+}
+
+/**
+ * Make a sorted run the final output: it is renamed if it is in the plain format,
+ * otherwise it is converted by a merge with a single input, which also copies it
+ * when it is in a scratch directory on another file system.
+ *
+ * @param durability When the output is flushed to storage.
+ */
+static void moveRunToOutput(const std::string& run, const std::string& output_file, Durability durability) {
+    std::error_code error;
+    if (runFormat(run) == RunFormat::Plain)
+        std::filesystem::rename(run, output_file, error);
+    if (runFormat(run) != RunFormat::Plain || error) {
+        kWayMergeFiles({run}, output_file, MAX_MEMORY, durability);
+        return;
+    }
+    unlink(offsetIndexName(run).c_str());
+    if (durability != Durability::None)
+        syncFile(output_file);
 }
 
 /**
@@ -259,26 +939,25 @@ static std::vector<std::string> genSequenceFiles(
 ) {
     size_t usable_mem = (max_memory * 8) / 10; // Leaving a 20% of space to the output buffer
     std::vector<Record> unsorted;
-    std::deque<Record> output_buffer;
-    size_t output_buffer_size = 0;
     std::priority_queue<Record, std::vector<Record>, HeapRecordComparator> heap;
     size_t heap_batch_size = 0;
     std::vector<Record> buffer;
     int out_fd;
-    size_t io_offset = 0;
     std::vector<std::string> output_files;
 
     /* Skip the unsorted initialization and push the records directly to the heap */
     int fd = openFile(input_filename);
-    ssize_t bytes_read = readRecordsFromFile(fd, heap, offset, std::min(usable_mem, bytes_to_process));
-    ssize_t run = 1, curr_offset = offset + bytes_read, free_bytes = usable_mem - bytes_read, last_read = bytes_read;
+    RunReader reader(fd, offset, bytes_to_process);
+    ssize_t bytes_read = reader.read(heap, std::min(usable_mem, bytes_to_process));
+    ssize_t run = 1, free_bytes = usable_mem - bytes_read, last_read = bytes_read;
     ssize_t bytes_remaining = bytes_to_process - bytes_read;
 
     while (bytes_remaining > 0 || !heap.empty() || !unsorted.empty()) { // I have to process all the bytes in the file
-        std::string output_filename = output_filename_prefix + std::to_string(run);
+        std::string output_filename = runFileName(output_filename_prefix + std::to_string(run), RUN_TIER);
         output_files.push_back(output_filename);
 
         out_fd = openFile(output_filename);
+        RunWriter out(out_fd, max_memory - usable_mem, nullptr, Durability::None, 0, runFormat(output_filename));
         bytes_remaining = bytes_to_process - bytes_read;
 
         heap_batch_size = std::max(1UL, heap.size()/20);
@@ -290,22 +969,20 @@ static std::vector<std::string> genSequenceFiles(
                 heap.pop();
                 record_key = record.key;
 
-                /* Flush the buffer to the output file and store the bytes freed */
+                /* Copy the record to the output buffer and store the bytes freed */
                 free_bytes += record.size();
-                output_buffer_size += record.size();
-                output_buffer.push_back(std::move(record));
+                out.append(record);
             }
             /* Now record key is the last read */
             if (bytes_remaining > 0) {
                 /* If there are bytes remained to process, read them into the buffer or at least read some bytes */
-                last_read = readRecordsFromFile(fd, buffer, curr_offset, std::min(bytes_remaining, free_bytes));
+                last_read = reader.read(buffer, std::min(bytes_remaining, free_bytes));
                 /**
                  * If I manage to read something I have to update the free_bytes counter
                  * and the bytes_read counter
                  */
                 free_bytes -= last_read;
                 bytes_read += last_read;
-                curr_offset += last_read;
                 bytes_remaining = bytes_to_process - bytes_read;
             }
             for (auto& r : buffer) {
@@ -313,12 +990,6 @@ static std::vector<std::string> genSequenceFiles(
                 else heap.push(std::move(r));
             }
             buffer.clear();
-
-            if (output_buffer_size > max_memory - usable_mem) {
-                io_offset += appendToFile(out_fd, std::move(output_buffer), output_buffer_size);
-                output_buffer.clear();
-                output_buffer_size = 0;
-            }
         }
 
         /* If I'm here it means that the heap is empty, so let's process the unsorted set */
@@ -327,11 +998,7 @@ static std::vector<std::string> genSequenceFiles(
 
         /* Now the heap is full again and we can clear the unsorted set */
         unsorted.clear();
-        if (output_buffer_size) {
-            io_offset += appendToFile(out_fd, std::move(output_buffer), output_buffer_size);
-            output_buffer.clear();
-            output_buffer_size = 0;
-        }
+        out.close();
         close(out_fd);
         run++;
     }
@@ -339,52 +1006,361 @@ static std::vector<std::string> genSequenceFiles(
     return output_files;
 }
 
+/**
+ * Write a sorted chunk to fd through a RunWriter with buffer_memory bytes of buffers,
+ * and empty it. The file is preallocated for the whole chunk.
+ *
+ * @param io The backend, or nullptr for a RunWriter with its own I/O thread.
+ * @param durability When the run is flushed to storage, None for the temporary runs.
+ * @param name The name of a temporary run, it tells its format (see run_format.hpp), and a plain
+ *             run gets an offset index for a partitioned merge of it. Empty for the final output.
+ */
+template<typename Chunk>
+static void writeRun(int fd, Chunk& chunk, IoBackend* io, size_t buffer_memory,
+                     Durability durability = Durability::None, const std::string& name = "") {
+    RunWriter out(fd, buffer_memory, io, durability, chunk.bytes(), runFormat(name));
+    if (!name.empty())
+        out.indexRecords(name, RUN_INDEX_INTERVAL);
+    if constexpr (is_fixed_chunk<Chunk>::value) {
+        out.append(chunk.data(), chunk.bytes());
+    } else {
+        for (const auto& tag : chunk.tags)
+            out.append(chunk.record(tag), chunk.recordSize(tag));
+    }
+    out.close();
+    chunk.clear();
+}
+
+/**
+ * Read the next chunk of a run generation loop: the whole records in chunk_mem bytes, but
+ * at least the next record however long it is, so that a small budget still makes progress.
+ * Whole records that run out before the end of the region are an error, not the end of it.
+ *
+ * @return The number of bytes read.
+ */
+template<typename Chunk>
+static size_t readRunChunk(RunReader& reader, Chunk& chunk, size_t chunk_mem, const std::string& input_filename) {
+    size_t bytes_read = reader.read(chunk, std::max(chunk_mem, reader.nextRecordBytes()));
+    if (bytes_read == 0) {
+        std::cerr << "Truncated record at offset " << reader.offset() << " of " << input_filename << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    return bytes_read;
+}
+
+/* Chunks in the run generation pipeline: one read, one sorted and one written at a time */
+static constexpr size_t RUN_PIPELINE_CHUNKS = 3;
+
+/**
+ * Run generation as a pipeline of three stages, each on its own chunk of a third of
+ * usable_mem (less if the sort needs scratch, see chunkShares): while chunk i is sorted, chunk i + 1 is read by a reader thread and
+ * chunk i - 1 is written by a writer thread, then the chunks move one stage ahead.
+ * The disk is busy while the chunks are sorted, at the cost of runs a third as long.
+ */
+template<typename Chunk>
+static std::vector<std::string> genPipelinedRuns(
+    const std::string& input_filename,
+    size_t offset,
+    size_t bytes_to_process,
+    size_t usable_mem,
+    const std::string& output_filename_prefix,
+    unsigned int sort_threads
+) {
+    const size_t chunk_mem = usable_mem / chunkShares<Chunk>(RUN_PIPELINE_CHUNKS, sort_threads);
+    std::vector<std::string> output_files;
+    int input_fd = openFile(input_filename);
+    RunReader reader(input_fd, offset, bytes_to_process);
+    std::unique_ptr<IoBackend> io = makeIoBackend();
+    Chunk chunks[RUN_PIPELINE_CHUNKS];
+    for (Chunk& chunk : chunks)
+        chunk.reserve(std::min(chunk_mem, bytes_to_process));
+
+    auto readStage = [&](Chunk& chunk) {
+        if (reader.remaining() > 0)
+            readRunChunk(reader, chunk, chunk_mem, input_filename);
+    };
+    auto writeStage = [&](Chunk& chunk) {
+        if (chunk.empty()) return;
+        std::string output_filename = runFileName(output_filename_prefix + std::to_string(output_files.size() + 1), RUN_TIER);
+        output_files.push_back(output_filename);
+        int fd = openFile(output_filename);
+        writeRun(fd, chunk, io.get(), usable_mem / 9, Durability::None, output_filename);
+        close(fd);
+    };
+
+    /* Step i sorts chunks[i % 3] while the next one is read and the previous one written */
+    readStage(chunks[0]);
+    for (size_t i = 0; !chunks[i % RUN_PIPELINE_CHUNKS].empty() || !chunks[(i + 2) % RUN_PIPELINE_CHUNKS].empty(); i++) {
+        std::thread reading(readStage, std::ref(chunks[(i + 1) % RUN_PIPELINE_CHUNKS]));
+        std::thread writing(writeStage, std::ref(chunks[(i + 2) % RUN_PIPELINE_CHUNKS]));
+        sortChunk(chunks[i % RUN_PIPELINE_CHUNKS], sort_threads);
+        reading.join();
+        writing.join();
+    }
+    close(input_fd);
+    return output_files;
+}
+
+/**
+ * Run generation loop shared by the two chunk types: read a chunk, sort its tags
+ * and write it back in one pass. With a MappedChunk the records are never copied
+ * into the heap, the write gathers them directly from the mapped input.
+ * When the records are copied and there is more than a chunk to sort, the steps
+ * overlap in a pipeline instead (see genPipelinedRuns); a MappedChunk is read by
+ * the sort itself, as it faults in the pages.
+ */
+template<typename Chunk>
+static std::vector<std::string> genSortedRuns(
+    const std::string& input_filename,
+    size_t offset,
+    size_t bytes_to_process,
+    size_t usable_mem,
+    const std::string& output_filename_prefix,
+    unsigned int sort_threads
+) {
+    const size_t chunk_mem = usable_mem / chunkShares<Chunk>(1, sort_threads);
+    if constexpr (!std::is_same_v<Chunk, MappedChunk>) {
+        if (bytes_to_process > chunk_mem)
+            return genPipelinedRuns<Chunk>(input_filename, offset, bytes_to_process, usable_mem,
+                                           output_filename_prefix, sort_threads);
+    }
+    size_t run = 1;
+    std::vector<std::string> output_files;
+    int input_fd = openFile(input_filename);
+    RunReader reader(input_fd, offset, bytes_to_process);
+    std::unique_ptr<IoBackend> io = makeIoBackend();
+    /* A single chunk is used for all the runs produced by this call */
+    Chunk buffer;
+    if constexpr (!std::is_same_v<Chunk, MappedChunk>)
+        buffer.reserve(std::min(chunk_mem, bytes_to_process));
+    while (reader.remaining() > 0) {
+        readRunChunk(reader, buffer, chunk_mem, input_filename);
+
+        sortChunk(buffer, sort_threads);
+        std::string output_filename = runFileName(output_filename_prefix + std::to_string(run), RUN_TIER);
+        output_files.push_back(output_filename);
+        int fd = openFile(output_filename);
+
+        writeRun(fd, buffer, io.get(), usable_mem / 9, Durability::None, output_filename);
+
+        close(fd);
+
+        run++;
+    }
+    close(input_fd);
+    return output_files;
+}
+
 /**
  * This is a simple implementation that reads chunks of data fitting in max_memory,
- * sorts them using std::sort, and flushes them to disk. It is compatible with the
+ * sorts them using sortChunk, and flushes them to disk. It is compatible with the
  * merge-based approach and produces sorted runs for external merge sort.
+ * When TAG_SORT is set, the chunks are mapped instead of copied (see MappedChunk).
+ * Records with a fixed length and a small payload are sorted in place (see FixedChunk).
  *
  * @param input_filename The input file name.
  * @param offset The offset to start reading from.
  * @param bytes_to_process The number of bytes to process.
  * @param max_memory The maximum memory to use.
  * @param output_filename_prefix The prefix for the output file names.
+ * @param sort_threads The number of threads used to sort each chunk.
  */
 static std::vector<std::string> genSequenceFilesSTL(
     const std::string& input_filename,
     size_t offset,
     size_t bytes_to_process,
     size_t max_memory,
-    const std::string& output_filename_prefix
+    const std::string& output_filename_prefix,
+    unsigned int sort_threads = 1
 ) {
     size_t usable_mem = (max_memory * 9) / 10; // Leave 10% for buffers, pointers, etc.
-    size_t bytes_read = 0;
-    size_t curr_offset = offset;
-    size_t run = 1;
-    std::vector<std::string> output_files;
-    int input_fd = openFile(input_filename);
-    while (bytes_read < bytes_to_process) {
-        std::vector<Record> buffer;
-        size_t chunk_size = std::min(usable_mem, bytes_to_process - bytes_read);
-        ssize_t actual_bytes_read = readRecordsFromFile(input_fd, buffer, curr_offset, chunk_size);
-        if (actual_bytes_read <= 0) break;
+    switch (RECORD_STRIDE ? RECORD_STRIDE - RECORD_HEADER_SIZE : 0) {
+        case 8:  return genSortedRuns<FixedChunk<8>>(input_filename, offset, bytes_to_process, usable_mem, output_filename_prefix, sort_threads);
+        case 16: return genSortedRuns<FixedChunk<16>>(input_filename, offset, bytes_to_process, usable_mem, output_filename_prefix, sort_threads);
+        case 32: return genSortedRuns<FixedChunk<32>>(input_filename, offset, bytes_to_process, usable_mem, output_filename_prefix, sort_threads);
+        case 64: return genSortedRuns<FixedChunk<64>>(input_filename, offset, bytes_to_process, usable_mem, output_filename_prefix, sort_threads);
+        default: break; // Any other stride only saves the header scan
+    }
+    if (TAG_SORT)
+        return genSortedRuns<MappedChunk>(input_filename, offset, bytes_to_process, usable_mem, output_filename_prefix, sort_threads);
+    return genSortedRuns<RecordChunk>(input_filename, offset, bytes_to_process, usable_mem, output_filename_prefix, sort_threads);
+}
 
-        curr_offset += actual_bytes_read;
-        bytes_read += actual_bytes_read;
+/* Records in bytes of serialized records: exact with RECORD_STRIDE, else bounded as if all the payloads were empty */
+static inline size_t estimatedRecords(size_t bytes) {
+    return bytes / (RECORD_STRIDE ? RECORD_STRIDE : RECORD_HEADER_SIZE);
+}
 
-        std::sort(buffer.begin(), buffer.end(), RecordComparator{});
-        std::string output_filename = output_filename_prefix + std::to_string(run);
-        output_files.push_back(output_filename);
-        int fd = openFile(output_filename);
+/**
+ * Whether records records of bytes bytes can be sorted as a single chunk within MAX_MEMORY:
+ * the slab, the tags and the scratch of their sort with NTHREADS threads (see sortScratchCopies).
+ */
+static inline bool fitsInMemory(size_t bytes, size_t records) {
+    return bytes + (1 + sortScratchCopies(NTHREADS)) * sizeof(RecordTag) * records <= MAX_MEMORY;
+}
 
-        appendToFile(fd, std::move(buffer), actual_bytes_read);
+/**
+ * Whether a file of file_size bytes can be sorted as a single chunk within MAX_MEMORY
+ * (see sortInMemory). It must be checked before MAX_MEMORY is capped to the file size.
+ */
+static inline bool fitsInMemory(size_t file_size) {
+    return fitsInMemory(file_size, estimatedRecords(file_size));
+}
 
+/**
+ * Write the records of a sorted chunk to a new file with nthreads threads.
+ * The output offset of every block of tags is found with a prefix sum of the record
+ * sizes, then each thread gathers its block into its own slice of the mapped file.
+ * The mapping is synced once at the end, unless the durability is None.
+ */
+static void writeChunkParallel(const RecordChunk& chunk, const std::string& output_filename, unsigned int nthreads,
+                               Durability durability) {
+    int fd = open(output_filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        std::cerr << "Error opening file for writing: " << output_filename << " " << strerror(errno) << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    if (chunk.bytes() == 0) {
         close(fd);
+        return;
+    }
+    if (ftruncate(fd, chunk.bytes()) != 0) {
+        std::cerr << "ftruncate failed: " << strerror(errno) << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    void* map_ptr = mmap(nullptr, chunk.bytes(), PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map_ptr == MAP_FAILED) {
+        std::cerr << "mmap failed: " << strerror(errno) << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    char* out = static_cast<char*>(map_ptr);
 
-        run++;
+    const size_t n = chunk.size();
+    std::vector<size_t> block_offset(nthreads + 1, 0);
+    #pragma omp parallel num_threads(nthreads)
+    {
+        const size_t t = omp_get_thread_num();
+        const size_t begin = (t * n) / nthreads;
+        const size_t end = ((t + 1) * n) / nthreads;
+
+        size_t bytes = 0;
+        for (size_t i = begin; i < end; i++)
+            bytes += chunk.recordSize(chunk.tags[i]);
+        block_offset[t + 1] = bytes;
+
+        #pragma omp barrier
+        #pragma omp single
+        for (size_t b = 1; b <= nthreads; b++)
+            block_offset[b] += block_offset[b - 1];
+
+        size_t offset = block_offset[t];
+        for (size_t i = begin; i < end; i++) {
+            size_t record_size = chunk.recordSize(chunk.tags[i]);
+            memcpy(out + offset, chunk.record(chunk.tags[i]), record_size);
+            offset += record_size;
+        }
+    }
+
+    if (durability != Durability::None && msync(map_ptr, chunk.bytes(), MS_SYNC) != 0)
+        std::cerr << "msync failed: " << strerror(errno) << std::endl;
+    munmap(map_ptr, chunk.bytes());
+    close(fd);
+}
+
+/**
+ * Sort a file that fits in memory without going through runs: the file is read
+ * into a single chunk by nthreads threads, each with its own slice, the records
+ * are indexed in parallel too, the tags are sorted with
+ * the parallel sample sort and the output is written once by writeChunkParallel.
+ *
+ * @param input_filename The input file name.
+ * @param output_filename The sorted output file.
+ * @param nthreads The thread budget.
+ */
+static void sortInMemory(const std::string& input_filename, const std::string& output_filename, unsigned int nthreads) {
+    const size_t file_size = getFileSize(input_filename);
+    nthreads = std::max(nthreads, 1u);
+    int fd = open(input_filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        std::cerr << "Error opening file: " << input_filename << " " << strerror(errno) << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    RecordChunk chunk;
+    chunk.reserve(file_size);
+    char* data = chunk.slab.get();
+    #pragma omp parallel for num_threads(nthreads)
+    for (size_t t = 0; t < nthreads; t++) {
+        size_t offset = (t * file_size) / nthreads;
+        const size_t end = ((t + 1) * file_size) / nthreads;
+        while (offset < end) {
+            ssize_t bytes_read = pread(fd, data + offset, end - offset, offset);
+            if (bytes_read <= 0) {
+                std::cerr << "Read error: " << (bytes_read < 0 ? strerror(errno) : "unexpected EOF") << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            offset += bytes_read;
+        }
+    }
+    close(fd);
+
+    size_t indexed;
+    if (RECORD_STRIDE) {
+        indexed = (file_size / RECORD_STRIDE) * RECORD_STRIDE;
+        chunk.tags.resize(file_size / RECORD_STRIDE);
+        #pragma omp parallel for num_threads(nthreads)
+        for (size_t i = 0; i < chunk.tags.size(); i++) {
+            chunk.tags[i].offset = i * RECORD_STRIDE;
+            memcpy(&chunk.tags[i].key, data + i * RECORD_STRIDE, sizeof(unsigned long));
+        }
+    } else {
+        /**
+         * The ranges are delimited in parallel (see findChunkBounds), then each one is walked
+         * twice: to count its records, then to write their tags at its place in the chunk
+         */
+        const std::vector<size_t> bounds = findChunkBounds(input_filename, std::max<size_t>(file_size / nthreads, 1), nthreads);
+        const size_t nranges = bounds.empty() ? 0 : bounds.size() - 1;
+        std::vector<size_t> first_tag(nranges + 1, 0);
+        #pragma omp parallel for schedule(dynamic, 1) num_threads(nthreads)
+        for (size_t r = 0; r < nranges; r++) {
+            size_t records = 0;
+            indexRecords(data + bounds[r], bounds[r + 1] - bounds[r], VariableLayout(), [&](uint64_t, size_t) { records++; });
+            first_tag[r + 1] = records;
+        }
+        for (size_t r = 0; r < nranges; r++)
+            first_tag[r + 1] += first_tag[r];
+
+        chunk.tags.resize(first_tag[nranges]);
+        #pragma omp parallel for schedule(dynamic, 1) num_threads(nthreads)
+        for (size_t r = 0; r < nranges; r++) {
+            size_t i = first_tag[r];
+            indexRecords(data + bounds[r], bounds[r + 1] - bounds[r], VariableLayout(), [&](uint64_t key, size_t offset) {
+                chunk.tags[i++] = {key, bounds[r] + offset};
+            });
+        }
+        /* A partial record at the end of the file is left out of the bounds */
+        indexed = bounds.empty() ? 0 : bounds.back();
+    }
+    if (indexed != file_size) {
+        std::cerr << "Truncated record at offset " << indexed << " of " << input_filename << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    chunk.used = file_size;
+
+    sortChunk(chunk, nthreads);
+    if (DIRECT_IO) {
+        /* Direct writes need aligned blocks, so the output is written sequentially */
+        int out_fd = open(output_filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+        if (out_fd < 0) {
+            std::cerr << "Error opening file for writing: " << output_filename << " " << strerror(errno) << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        std::unique_ptr<IoBackend> io = makeIoBackend();
+        writeRun(out_fd, chunk, io.get(), MAX_MEMORY - file_size, OUTPUT_DURABILITY);
+        close(out_fd);
+    } else {
+        writeChunkParallel(chunk, output_filename, nthreads, OUTPUT_DURABILITY);
     }
-    close(input_fd);
-    return output_files;
 }
 
 #endif // _SORTING_HPP
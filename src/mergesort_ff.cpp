@@ -23,8 +23,19 @@ int main(int argc, char *argv[]) {
     if((start = parseCommandLine(argc, argv)) < 0) return -1;
     std::string filename = argv[start];
     size_t file_size = getFileSize(filename);
+    if (FIXED_RECORDS)
+        RECORD_STRIDE = probeRecordStride(filename);
+    bool in_memory = fitsInMemory(file_size);
     MAX_MEMORY = std::min(MAX_MEMORY, file_size + (file_size/10));
     std::filesystem::path p(filename);
+
+    /* The file fits in memory, so the farm is not needed: it is read, sorted and written once */
+    if (in_memory) {
+        timer_start();
+        sortInMemory(filename, p.parent_path().string() + "/output.dat", NTHREADS);
+        timer_stop("mergesort_ff_in_memory");
+        return 0;
+    }
     ff::ff_farm farm;
     Master m(filename, p.parent_path().string());
     farm.add_emitter(&m);
@@ -36,10 +36,16 @@ int main(int argc, char *argv[]) {
     if (rank == 0) {
          size_t file_size = getFileSize(filename);
          MAX_MEMORY = std::min(MAX_MEMORY, file_size + (file_size / 10));
+         if (FIXED_RECORDS)
+             RECORD_STRIDE = probeRecordStride(filename);
     }
     uint64_t max_mem_wire = (rank == 0) ? (uint64_t)MAX_MEMORY : 0;
     MPI_Bcast(&max_mem_wire, 1, MPI_UNSIGNED_LONG_LONG, 0, MPI_COMM_WORLD);
     MAX_MEMORY = (size_t)max_mem_wire;
+    /* The workers parse the received chunks with the same layout as the master */
+    uint64_t stride_wire = (rank == 0) ? (uint64_t)RECORD_STRIDE : 0;
+    MPI_Bcast(&stride_wire, 1, MPI_UNSIGNED_LONG_LONG, 0, MPI_COMM_WORLD);
+    RECORD_STRIDE = (size_t)stride_wire;
 
     if (rank == 0) {
         TIMERSTART(mergesort_mpi)
@@ -21,6 +21,9 @@ int main(int argc, char *argv[]) {
     omp_set_num_threads(NTHREADS);
     std::string filename = argv[start];
     size_t file_size = getFileSize(filename);
+    if (FIXED_RECORDS)
+        RECORD_STRIDE = probeRecordStride(filename);
+    bool in_memory = fitsInMemory(file_size);
     MAX_MEMORY = std::min(MAX_MEMORY, file_size + (file_size/10));
 
     std::filesystem::path p(filename);
@@ -29,8 +32,13 @@ int main(int argc, char *argv[]) {
     std::string output_file = p.parent_path().string() + "/output.dat";
 
     TIMERSTART(mergesort_omp)
-    std::vector<std::string> sequences = genRuns(filename, run_prefix);
-    ompMerge(sequences, merge_prefix, output_file);
+    if (in_memory) {
+        /* No runs at all, the file is read, sorted and written once */
+        sortInMemory(filename, output_file, NTHREADS);
+    } else {
+        std::vector<std::string> sequences = genRuns(filename, run_prefix, merge_prefix);
+        ompMerge(sequences, merge_prefix, output_file, OUTPUT_DURABILITY);
+    }
     TIMERSTOP(mergesort_omp)
 
     return 0;
@@ -13,6 +13,7 @@
 #include <filesystem>
 
 void binaryMerge(std::vector<std::string> &sequences, const std::string &merge_prefix, const std::string &output_file, size_t max_memory) {
+    if (sequences.empty()) return;
     std::vector<std::vector<std::string>> levels;
     levels.push_back({});
     if (sequences.size() % 2) {
@@ -20,8 +21,8 @@ void binaryMerge(std::vector<std::string> &sequences, const std::string &merge_p
         sequences.pop_back();
     }
 
-    for (size_t i = 0; i < sequences.size() - 1; i+=2) {
-        std::string filename = merge_prefix + generateUUID();
+    for (size_t i = 0; i + 1 < sequences.size(); i+=2) {
+        std::string filename = runFileName(merge_prefix + generateUUID(), MERGE_TIER);
         mergeFiles(sequences[i], sequences[i + 1], filename, MAX_MEMORY);
         levels[0].push_back(filename);
     }
@@ -33,14 +34,15 @@ void binaryMerge(std::vector<std::string> &sequences, const std::string &merge_p
             levels[current_level].push_back(levels[current_level - 1].back());
             levels[current_level - 1].pop_back();
         }
-        for (size_t i = 0; i < levels[current_level - 1].size() - 1; i += 2) {
-            std::string filename = merge_prefix + generateUUID();
+        for (size_t i = 0; i + 1 < levels[current_level - 1].size(); i += 2) {
+            std::string filename = runFileName(merge_prefix + generateUUID(), MERGE_TIER);
             mergeFiles(levels[current_level - 1][i], levels[current_level - 1][i + 1], filename, MAX_MEMORY);
             levels[current_level].push_back(filename);
         }
         current_level++;
     }
-    std::filesystem::rename(levels.back().back(), output_file);
+    /* The last merge may be compressed or columnar, moveRunToOutput turns it into a plain output */
+    moveRunToOutput(levels.back().back(), output_file, OUTPUT_DURABILITY);
 }
 
 int main(int argc, char *argv[]) {
@@ -49,18 +51,29 @@ int main(int argc, char *argv[]) {
         return -1;
     std::string filename = argv[start];
     size_t file_size = getFileSize(filename);
+    if (FIXED_RECORDS)
+        RECORD_STRIDE = probeRecordStride(filename);
     MAX_MEMORY = std::min(MAX_MEMORY, file_size + (file_size/10));
     std::filesystem::path p(filename);
     std::string run_prefix = p.parent_path().string() + "/run#";
     std::string merge_prefix = p.parent_path().string() + "/merge#";
     std::string output_file = p.parent_path().string() + "/output.dat";
     TIMERSTART(mergesort_seq)
-    std::vector<std::string> sequences = genSequenceFilesSTL(filename, 0, getFileSize(filename), MAX_MEMORY, run_prefix);
-    if (sequences.size() == 1)
-        std::filesystem::rename(sequences[0], output_file);
+    /* Run generation is the only phase that can use more than one core here */
+    std::vector<std::string> sequences = genSequenceFilesSTL(filename, 0, getFileSize(filename), MAX_MEMORY, run_prefix, NTHREADS);
+    if (sequences.empty()) {
+        /* An empty input gives an empty output */
+        int fd = open(output_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (fd < 0) {
+            std::cerr << "Error opening output file: " << output_file << " " << strerror(errno) << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        close(fd);
+    } else if (sequences.size() == 1)
+        moveRunToOutput(sequences[0], output_file, OUTPUT_DURABILITY);
     else {
         if (KWAY_MERGE)
-            kWayMergeFiles(sequences, output_file, MAX_MEMORY);
+            kWayMergeFiles(sequences, output_file, MAX_MEMORY, OUTPUT_DURABILITY);
         else
             binaryMerge(sequences, merge_prefix, output_file, MAX_MEMORY);
     }
@@ -10,6 +10,17 @@
 #include <vector>
 #include <filesystem>
 
+/* The runs must hold every byte of the input, however small the memory budget is (e.g. -m 200) */
+static bool coversInput(const std::vector<std::string>& sequences, size_t file_size) {
+    size_t bytes = 0;
+    for (const auto& seq : sequences) {
+        if (runFormat(seq) != RunFormat::Plain) return true; // Only plain runs are measured by their size
+        bytes += getFileSize(seq);
+    }
+    if (bytes != file_size)
+        std::cerr << "The runs hold " << bytes << " bytes out of the " << file_size << " of the input" << std::endl;
+    return bytes == file_size;
+}
 
 int main(int argc, char *argv[]) {
     int start = 0;
@@ -20,21 +31,26 @@ int main(int argc, char *argv[]) {
     std::filesystem::path p(filename);
     std::string run_prefix = p.parent_path().string() + "/run#";
     std::vector<std::string> sequences;
+    bool covered;
     TIMERSTART(std_sort)
     sequences = genSequenceFilesSTL(filename, 0, getFileSize(filename), MAX_MEMORY, run_prefix);
     TIMERSTOP(std_sort)
     std::cout << "Number of sorted runs: " << sequences.size() << std::endl;
+    covered = coversInput(sequences, getFileSize(filename));
     for (const auto& seq : sequences) {
-        deleteFile(seq.c_str());
+        deleteRun(seq);
     }
+    if (!covered) return EXIT_FAILURE;
 
     TIMERSTART(snow_plow)
     sequences = genSequenceFiles(filename, 0, getFileSize(filename), MAX_MEMORY, run_prefix);
     TIMERSTOP(snow_plow)
     std::cout << "Number of sorted runs: " << sequences.size() << std::endl;
+    covered = coversInput(sequences, getFileSize(filename));
     for (const auto& seq : sequences) {
-        deleteFile(seq.c_str());
+        deleteRun(seq);
     }
+    if (!covered) return EXIT_FAILURE;
 
     return 0;
 }